@@ -1,5 +1,6 @@
+#define _GNU_SOURCE     // struct ucred, SO_PEERCRED
 #define NURU_IMPLEMENTATION
-#define NURU_SCOPE static
+#define NURU_SCOPE static inline
 
 #include <stdio.h>      // fprintf(), stdout, setlinebuf()
 #include <stdlib.h>     // EXIT_SUCCESS, EXIT_FAILURE, rand()
@@ -9,9 +10,21 @@
 #include <termios.h>    // struct winsize, struct termios, tcgetattr(), ...
 #include <sys/ioctl.h>  // ioctl(), TIOCGWINSZ
 #include <locale.h>     // setlocale(), LC_CTYPE
-#include <wchar.h>      // fwide(), wchar_t
+#include <wchar.h>      // wchar_t, wcrtomb()
+#include <stdarg.h>     // va_list, va_start(), va_end()
+#include <getopt.h>     // getopt_long(), struct option
 #include <limits.h>     // PATH_MAX (don't hit me)
+#include <fcntl.h>      // open(), O_RDWR, O_NOCTTY
+#include <poll.h>       // poll(), struct pollfd
+#include <errno.h>      // errno, EEXIST
+#include <sys/stat.h>   // mkdir(), stat()
+#include <signal.h>     // signal(), SIGPIPE
+#include <sys/time.h>   // setitimer(), struct itimerval
+#include <pthread.h>    // pthread_create(), pthread_mutex_t, ...
 #include "nuru.h"       // nuru minimal reference implementation
+#include "nuru-tile.h"  // tiled nuru images
+#include "nuru-layer.h" // composing images from layers
+#include "nuru-daemon.h" // render requests over a Unix socket
 
 // program information
 
@@ -26,38 +39,291 @@
 // ANSI escape codes
 // https://en.wikipedia.org/wiki/ANSI_escape_code#8-bit
 
-#define ANSI_FONT_RESET   L"\x1b[0m"
-#define ANSI_FONT_BOLD    L"\x1b[1m"
-#define ANSI_FONT_NORMAL  L"\x1b[22m"
-#define ANSI_FONT_FAINT   L"\x1b[2m"
+#define ANSI_FONT_RESET   "\x1b[0m"
+#define ANSI_SGR_MAX      80 // longest SGR parameter string we'd produce
+#define ANSI_FONT_BOLD    "\x1b[1m"
+#define ANSI_FONT_NORMAL  "\x1b[22m"
+#define ANSI_FONT_FAINT   "\x1b[2m"
 
-#define ANSI_HIDE_CURSOR  L"\e[?25l"
-#define ANSI_SHOW_CURSOR  L"\e[?25h"
+// text attributes that show on spaces, too; the others only affect glyphs
+#define ATTRS_SPACE       (NURU_MD_UNDERLINE | NURU_MD_REVERSE)
 
-#define ANSI_CLEAR_SCREEN L"\x1b[2J"
-#define ANSI_CURSOR_RESET L"\x1b[H"
+#define ANSI_HIDE_CURSOR  "\e[?25l"
+#define ANSI_SHOW_CURSOR  "\e[?25h"
+
+#define ANSI_CANCEL       "\x18" // CAN, aborts an escape sequence in progress
+
+#define ANSI_SYNC_BEGIN   "\x1b[?2026h" // hold off painting until ANSI_SYNC_END
+#define ANSI_SYNC_END     "\x1b[?2026l"
+#define ANSI_ALT_SCREEN   "\x1b[?1049h" // switch to the alternate screen
+#define ANSI_MAIN_SCREEN  "\x1b[?1049l" // and back to the normal one
+
+#define ANSI_CLEAR_SCREEN "\x1b[2J"
+#define ANSI_CURSOR_RESET "\x1b[H"
+#define ANSI_CURSOR_RIGHT "\x1b[C"
+#define ANSI_CURSOR_RIGHT_N "\x1b[%dC"
+#define ANSI_CURSOR_MOVE  "\x1b[%d;%dH"
+
+#define GLYPH_UPPER_HALF  0x2580 // ▀
+#define GLYPH_LOWER_HALF  0x2584 // ▄
+
+#define OUT_BUF_SIZE      65536 // bytes of output we buffer before writing
+#define OUT_CHUNK_MAX     4096  // max bytes per write when pacing output
+#define OUT_PACE_SLICE    20    // with --rate, write this many chunks per second
+#define OUT_WAIT_DAEMON   3000  // ms the daemon waits for a client's output to drain
+#define PAL_CACHE_SIZE    16    // number of palettes kept around in batch mode
+#define IMG_CACHE_SIZE    8     // number of decoded images kept by the daemon
+#define CAPS_CACHE_SIZE   8     // number of terminal types the daemon remembers
+#define PREFETCH_DEFAULT  4     // files read ahead in batch mode, unless given
+#define PREFETCH_MAX      32    // max files read ahead, one thread each
+
+// long-only command line options
+
+#define OPT_STATS         256
+#define OPT_VALIDATE      257
+#define OPT_MEM_BUDGET    258
+#define OPT_DAEMON        259
+#define OPT_PREFETCH      260
+#define OPT_RATE          261
+#define OPT_HOLD          262
+#define OPT_ALT_SCREEN    263
+
+// terminal queries, see XTGETTCAP and DA1 in xterm's ctlseqs
+// https://invisible-island.net/xterm/ctlseqs/ctlseqs.html
+
+#define QUERY_XTGETTCAP   "\x1bP+q524742;636f6c6f7273\x1b\\" // "RGB", "colors"
+#define QUERY_DECRQM_SYNC "\x1b[?2026$p"  // synchronized output, see DECRQM
+#define QUERY_DA1         "\x1b[c"
+#define QUERY_TIMEOUT     250 // ms
+
+#define HOLD_POLL_MS      250 // with --hold, check the terminal size this often
+
+// terminal color depths, in bits
+
+#define TERM_DEPTH_NONE    0
+#define TERM_DEPTH_4BIT    4
+#define TERM_DEPTH_8BIT    8
+#define TERM_DEPTH_24BIT  24
+
+typedef struct term_caps
+{
+	uint8_t depth;         // color depth supported by the terminal
+	uint8_t sync;          // terminal supports synchronized output (mode 2026)
+}
+term_caps_s;
+
+typedef struct color
+{
+	uint8_t depth;         // TERM_DEPTH_*, TERM_DEPTH_NONE for no color
+	uint8_t idx;           // ANSI color index, for 4 and 8 bit depth
+	nuru_rgb_s rgb;        // RGB value, for 24 bit depth
+}
+color_s;
+
+typedef struct pen
+{
+	color_s fg;            // foreground color currently set in the terminal
+	color_s bg;            // background color currently set in the terminal
+	uint8_t attrs;         // text attributes currently set, NURU_MD_* bits
+}
+pen_s;
+
+typedef struct output
+{
+	int fd;                // file descriptor to write to
+	char buf[OUT_BUF_SIZE];// output that hasn't been written yet
+	size_t len;            // number of bytes in buf
+	pen_s pen;             // colors currently set in the terminal
+	nuru_stats_s *stats;   // if not NULL, output stats are recorded here
+	size_t rate;           // max bytes written per second, 0 for no limit
+	size_t chunk;          // max bytes per write, with a rate limit
+	uint64_t paced_ns;     // when the current stretch of paced output began
+	uint64_t paced;        // bytes written since then
+	uint8_t sync;          // wrap frames in synchronized output sequences
+	uint8_t alt;           // output goes to the alternate screen
+	int peer;              // the daemon's client, stop if it hangs up; -1 if none
+	int wait;              // max ms to wait for fd to take output, 0 for no limit
+	volatile sig_atomic_t *stop; // if set, stop writing and drop the output
+	struct sigaction sig_old[4]; // signal handlers before term_setup()
+}
+output_s;
+
+typedef struct area
+{
+	uint16_t col;          // first terminal column to print
+	uint16_t row;          // first terminal row to print
+	uint16_t cols;         // number of terminal columns to print
+	uint16_t rows;         // number of terminal rows to print
+	uint8_t place;         // move the cursor to every row, no line breaks
+}
+area_s;
+
+typedef struct pal_cache
+{
+	nuru_pal_s pals[PAL_CACHE_SIZE];
+	char keys[PAL_CACHE_SIZE][NURU_STR_LEN + 8]; // type and name, "" if unused
+	uint64_t used[PAL_CACHE_SIZE];   // when each palette was last used
+	uint64_t clock;        // incremented on every lookup
+}
+pal_cache_s;
+
+typedef struct img_cache
+{
+	nuru_img_s imgs[IMG_CACHE_SIZE];
+	char *paths[IMG_CACHE_SIZE];     // real path of each image, NULL if unused
+	struct stat sts[IMG_CACHE_SIZE]; // file info when loaded, to spot changes
+	uint64_t used[IMG_CACHE_SIZE];   // when each image was last used
+	uint64_t clock;        // incremented on every lookup
+	uint8_t enabled;       // only the daemon keeps images around
+}
+img_cache_s;
+
+typedef struct caps_cache
+{
+	term_caps_s caps[CAPS_CACHE_SIZE];
+	char keys[CAPS_CACHE_SIZE][128]; // TERM and COLORTERM
+	size_t num;            // number of terminal types seen so far
+}
+caps_cache_s;
+
+typedef struct fetch
+{
+	char *file;            // file to read
+	uint8_t *data;         // contents of the file, NULL if it wasn't read
+	size_t len;            // number of bytes in data
+	uint8_t done;          // reading has finished, one way or the other
+}
+fetch_s;
+
+typedef struct prefetch
+{
+	fetch_s slots[PREFETCH_MAX];
+	size_t num_slots;      // max number of files in flight
+	size_t head;           // next file to be processed
+	size_t next;           // next file to be read by a worker
+	size_t tail;           // next free slot
+	size_t max_len;        // larger files are left to the regular load
+	pthread_t threads[PREFETCH_MAX];
+	size_t num_threads;    // number of workers started
+	pthread_mutex_t lock;
+	pthread_cond_t work;   // signaled when there's a file to read
+	pthread_cond_t done;   // signaled when a file has been read
+	uint8_t quit;          // workers should exit
+}
+prefetch_s;
 
 typedef struct options
 {
-	char *nui_file;        // nuru image file to load
+	char **nui_files;      // nuru image files to load
+	int num_files;         // number of files in nui_files
+	char *list_file;       // file with more image files, one per line
 	char *nug_file;        // nuru glyph palette file to load
 	char *nuc_file;        // nuru color palette file to load
 	uint8_t info;          // print image info and exit
 	uint8_t clear;         // clear terminal before printing
+	uint8_t overlay;       // skip transparent cells instead of printing them
+	uint8_t fit;           // scale images down to fit the terminal
+	uint8_t pixels;        // print glyph-less images with half-blocks
+	uint8_t probe;         // query terminal, even if cached info exists
+	uint8_t stats;         // print stats to stderr after rendering
+	uint8_t validate;      // check file integrity and exit
+	size_t mem_budget;     // max MiB of cells per image, 0 for the default
+	uint32_t view_x;       // first column to show of tiled images
+	uint32_t view_y;       // first row to show of tiled images
+	uint8_t zoom;          // level of tiled images to show, 0 is full size
+	uint8_t daemon;        // serve render requests instead
+	size_t rate;           // max bytes of output per second, 0 for no limit
+	uint8_t hold;          // keep images on screen until a key is pressed
+	uint8_t alt_screen;    // print to the alternate screen
+	uint8_t layers;        // compose the image files into one image
+	int prefetch;          // files to read ahead, -1 for the default
 	uint8_t help : 1;      // show help and exit
 	uint8_t version : 1;   // show version and exit
 }
 options_s;
 
+typedef struct state
+{
+	options_s *opts;       // command line options
+	term_caps_s caps;      // what the terminal can do
+	struct winsize ws;     // terminal size
+	nuru_img_s nui;        // current image, its cells are reused
+	nuru_img_s fit;        // current image, scaled to fit the terminal
+	nuru_pal_s nug;        // glyph palette given via command line
+	nuru_pal_s nuc;        // color palette given via command line
+	pal_cache_s pals;      // palettes loaded by name from images
+	img_cache_s imgs;      // decoded images, kept across daemon requests
+	nuru_tiled_s tiled;    // tiled image last shown, kept open for its tiles
+	char *tiled_path;      // real path of that tiled image, NULL if none open
+	struct stat tiled_st;  // file info when opened, to spot changes
+	caps_cache_s terms;    // terminal capabilities, by terminal type
+	output_s out;          // output buffer
+	uint8_t batch;         // more than one image to process
+	const char *tty;       // terminal to query for its capabilities
+	prefetch_s *pf;        // reads files ahead in batch mode, or NULL
+	fetch_s *fetched;      // contents of the file being processed, or NULL
+}
+state_s;
+
+/*
+ * Set to the number of the signal that asked us to stop, see term_setup().
+ */
+static volatile sig_atomic_t stop_signal;
+
+/*
+ * Set when the output couldn't be written within its max wait, see out_flush().
+ */
+static volatile sig_atomic_t out_expired;
+
+/*
+ * Set when the terminal has been resized, see hold().
+ */
+static volatile sig_atomic_t resized;
+
+/*
+ * Parse a size given as a number with an optional K or M suffix.
+ */
+static size_t
+parse_size(const char *str)
+{
+	char *end = NULL;
+	size_t size = strtoul(str, &end, 10);
+	switch (end ? *end : '\0')
+	{
+		case 'k':
+		case 'K':
+			return size << 10;
+		case 'm':
+		case 'M':
+			return size << 20;
+		default:
+			return size;
+	}
+}
+
 /*
  * Parse command line args into the provided options_s struct.
  */
 static void
 parse_args(int argc, char **argv, options_s *opts)
 {
+	struct option long_opts[] = {
+		{ "stats", no_argument, NULL, OPT_STATS },
+		{ "validate", no_argument, NULL, OPT_VALIDATE },
+		{ "mem-budget", required_argument, NULL, OPT_MEM_BUDGET },
+		{ "daemon", no_argument, NULL, OPT_DAEMON },
+		{ "prefetch", required_argument, NULL, OPT_PREFETCH },
+		{ "rate", required_argument, NULL, OPT_RATE },
+		{ "hold", no_argument, NULL, OPT_HOLD },
+		{ "alt-screen", no_argument, NULL, OPT_ALT_SCREEN },
+		{ 0 }
+	};
+
+	opts->prefetch = -1;
 	opterr = 0;
+	optind = 0;            // start over, the daemon parses args per request
 	int o;
-	while ((o = getopt(argc, argv, "b:c:Cf:g:ihV")) != -1)
+	while ((o = getopt_long(argc, argv, "b:c:Cf:g:ihl:LopPsVx:y:z:", long_opts, NULL)) != -1)
 	{
 		switch (o)
 		{
@@ -76,14 +342,70 @@ parse_args(int argc, char **argv, options_s *opts)
 			case 'i':
 				opts->info = 1;
 				break;
+			case 'l':
+				opts->list_file = optarg;
+				break;
+			case 'L':
+				opts->layers = 1;
+				break;
+			case 'o':
+				opts->overlay = 1;
+				break;
+			case 'p':
+				opts->pixels = 1;
+				break;
+			case 'P':
+				opts->probe = 1;
+				break;
+			case 's':
+				opts->fit = 1;
+				break;
 			case 'V':
 				opts->version = 1;
 				break;
+			case 'x':
+				opts->view_x = strtoul(optarg, NULL, 10);
+				break;
+			case 'y':
+				opts->view_y = strtoul(optarg, NULL, 10);
+				break;
+			case 'z':
+				opts->zoom = atoi(optarg);
+				break;
+			case OPT_STATS:
+				opts->stats = 1;
+				break;
+			case OPT_VALIDATE:
+				opts->validate = 1;
+				break;
+			case OPT_MEM_BUDGET:
+				// saturate, lest it wraps around when turned into bytes
+				opts->mem_budget = strtoul(optarg, NULL, 10);
+				opts->mem_budget = opts->mem_budget > SIZE_MAX >> 20 ? SIZE_MAX >> 20 : opts->mem_budget;
+				break;
+			case OPT_DAEMON:
+				opts->daemon = 1;
+				break;
+			case OPT_PREFETCH:
+				opts->prefetch = atoi(optarg);
+				break;
+			case OPT_RATE:
+				opts->rate = parse_size(optarg);
+				break;
+			case OPT_HOLD:
+				opts->hold = 1;
+				break;
+			case OPT_ALT_SCREEN:
+				// otherwise, the image would be gone again right away
+				opts->alt_screen = 1;
+				opts->hold = 1;
+				break;
 		}
 	}
 	if (optind < argc)
 	{
-		opts->nui_file = argv[optind];
+		opts->nui_files = &argv[optind];
+		opts->num_files = argc - optind;
 	}
 }
 
@@ -94,14 +416,33 @@ static void
 help(const char *invocation, FILE *where)
 {
 	fprintf(where, "USAGE\n");
-	fprintf(where, "\t%s [OPTIONS...] image_file\n\n", invocation);
+	fprintf(where, "\t%s [OPTIONS...] image_file...\n\n", invocation);
 	fprintf(where, "OPTIONS\n");
 	fprintf(where, "\t-C\tclear the console before printing\n");
 	fprintf(where, "\t-c FILE\tpath to color palette file to use\n");
 	fprintf(where, "\t-g FILE\tpath to glyph palette file to use\n");
 	fprintf(where, "\t-h\tprint this help text and exit\n");
 	fprintf(where, "\t-i\tshow image information and exit\n");
+	fprintf(where, "\t-l FILE\tread image files from FILE, one per line ('-' for stdin)\n");
+	fprintf(where, "\t-L\tcompose the image files, given as FILE[@COL,ROW[,Z]], into one\n");
+	fprintf(where, "\t-o\tleave terminal contents visible through transparent cells\n");
+	fprintf(where, "\t-p\tprint images without glyphs as half-blocks, two pixels per cell\n");
+	fprintf(where, "\t-P\tquery terminal capabilities, ignoring the cache\n");
+	fprintf(where, "\t-s\tscale images down to fit the terminal\n");
 	fprintf(where, "\t-V\tprint version information and exit\n");
+	fprintf(where, "\t-x COL\tfirst column to show of tiled images\n");
+	fprintf(where, "\t-y ROW\tfirst row to show of tiled images\n");
+	fprintf(where, "\t-z LEVEL\tlevel of tiled images to show, each halving the size\n");
+	fprintf(where, "\t--alt-screen\tprint to the alternate screen, restoring the terminal on exit (implies --hold)\n");
+	fprintf(where, "\t--daemon\tserve render requests from nuru-client, see NURU_SOCKET\n");
+	fprintf(where, "\t--hold\tkeep each image on screen until a key is pressed\n");
+	fprintf(where, "\t--mem-budget MIB\tlargest image to load, in MiB of cells (default: %lu)\n",
+			NURU_MEM_BUDGET >> 20);
+	fprintf(where, "\t--prefetch NUM\tfiles to read ahead in batch mode, 0 to disable (default: %d)\n",
+			PREFETCH_DEFAULT);
+	fprintf(where, "\t--rate BPS\tlimit output to BPS bytes per second (K and M suffixes work)\n");
+	fprintf(where, "\t--stats\tprint timing and output statistics to stderr\n");
+	fprintf(where, "\t--validate\tcheck images for truncation and checksum errors, then exit\n");
 }
 
 /*
@@ -133,6 +474,75 @@ info(nuru_img_s *img)
 	fprintf(stdout, "bg_key:     %d\n", img->bg_key);
 	fprintf(stdout, "glyph_pal:  %s\n", img->glyph_pal);
 	fprintf(stdout, "color_pal:  %s\n", img->color_pal);
+	if (img->version >= 2)
+	{
+		fprintf(stdout, "checksum:   %08x\n", img->checksum);
+	}
+}
+
+/*
+ * Print information about the tiled image, including the size of each level.
+ */
+static void
+info_tiled(nuru_tiled_s *t)
+{
+	nuru_img_s *img = &t->head;
+	fprintf(stdout, "signature:  %s\n", NURU_TILE_SIGNATURE);
+	fprintf(stdout, "color_mode: %d\n", img->color_mode);
+	fprintf(stdout, "glpyh_mode: %d\n", img->glyph_mode);
+	fprintf(stdout, "mdata_mode: %d\n", img->mdata_mode);
+	fprintf(stdout, "ch_key:     %d\n", img->ch_key);
+	fprintf(stdout, "fg_key:     %d\n", img->fg_key);
+	fprintf(stdout, "bg_key:     %d\n", img->bg_key);
+	fprintf(stdout, "glyph_pal:  %s\n", img->glyph_pal);
+	fprintf(stdout, "color_pal:  %s\n", img->color_pal);
+	fprintf(stdout, "tile_size:  %dx%d\n", t->tile_w, t->tile_h);
+	for (int l = 0; l < t->num_levels; ++l)
+	{
+		char label[16];
+		snprintf(label, sizeof(label), "level %d:", l);
+		fprintf(stdout, "%-12s%ux%u\n", label, t->levels[l].cols, t->levels[l].rows);
+	}
+}
+
+/*
+ * Describe the result of loading or validating an image.
+ */
+static const char *
+err_str(int err)
+{
+	switch (err)
+	{
+		case NURU_ERR_NONE:      return "OK";
+		case NURU_ERR_MEMORY:    return "out of memory";
+		case NURU_ERR_FILE_OPEN: return "can't open file";
+		case NURU_ERR_FILE_READ: return "read error";
+		case NURU_ERR_FILE_TYPE: return "not a nuru image";
+		case NURU_ERR_FILE_MODE: return "unknown mode";
+		case NURU_ERR_IMG_VER:   return "unsupported version";
+		case NURU_ERR_CHECKSUM:  return "checksum mismatch";
+		case NURU_ERR_FILE_SIZE: return "wrong file size";
+		case NURU_ERR_TOO_BIG:   return "too big for memory budget";
+		default:                 return "error";
+	}
+}
+
+/*
+ * Print load, render and output statistics.
+ */
+static void
+stats(nuru_stats_s *st, FILE *where)
+{
+	fprintf(where, "load:       %.3f ms\n", st->load_ns / 1000000.0);
+	fprintf(where, "decode:     %.3f ms\n", st->decode_ns / 1000000.0);
+	fprintf(where, "render:     %.3f ms\n", st->render_ns / 1000000.0);
+	fprintf(where, "cells:      %zu\n", st->cells);
+	fprintf(where, "bytes:      %zu\n", st->out_bytes);
+	fprintf(where, "bytes/cell: %.2f\n", st->cells ? (double) st->out_bytes / st->cells : 0.0);
+	fprintf(where, "escapes:    %zu bytes\n", st->esc_bytes);
+	fprintf(where, "glyphs:     %zu bytes\n", st->glyph_bytes);
+	fprintf(where, "sgr:        %zu\n", st->sgr_changes);
+	fprintf(where, "writes:     %zu\n", st->writes);
 }
 
 /*
@@ -166,356 +576,2481 @@ term_echo(int on)
 }
 
 /*
- * Clear the entire terminal and move the cursor back to the top left.
+ * With a rate limit, wait until the bytes written so far are within budget. 
+ * After a pause in output (decoding the next image, say), pacing starts over, 
+ * so the pause doesn't turn into a burst.
  */
 static void
-term_clear()
+out_pace(output_s *out)
 {
-	fputws(ANSI_CLEAR_SCREEN, stdout);
-	fputws(ANSI_CURSOR_RESET, stdout);
+	uint64_t now = nuru_time_ns();
+	uint64_t due = out->paced_ns + out->paced * 1000000000 / out->rate;
+	if (now >= due)
+	{
+		if (now - due > 1000000000 / OUT_PACE_SLICE)
+		{
+			out->paced_ns = now;
+			out->paced = 0;
+		}
+		return;
+	}
+
+	// a signal cuts this short, which is what we want
+	struct timespec ts = { .tv_sec = (due - now) / 1000000000, .tv_nsec = (due - now) % 1000000000 };
+	nanosleep(&ts, NULL);
 }
 
 /*
- * Prepare the terminal for our matrix shenanigans.
+ * Write all buffered output to the output's file descriptor. While rendering, 
+ * a signal interrupts a blocked write() (see term_setup()); once asked to 
+ * stop, the rest of the output is dropped. Should someone have handed us a 
+ * non-blocking descriptor, we wait for it to become writable in between. 
+ * With a rate limit, output is written in small chunks, paced to stay within 
+ * the limit. With a max wait, we wait at most that long for the descriptor 
+ * to become writable, and a timer interrupts a write() that is blocked for 
+ * longer than that; if not even a single byte got through, nobody seems to 
+ * be reading, so we stop as if by SIGPIPE. Should the daemon's client hang 
+ * up in the meantime, we stop as if by SIGHUP.
  */
-static void
-term_setup(options_s *opts)
+static int
+out_flush(output_s *out)
 {
-	fputws(ANSI_HIDE_CURSOR, stdout);
-	term_echo(0);                      // don't show keyboard input
-	if (opts->clear) term_clear();     // if requested, clear terminal
+	size_t done = 0;
+	while (done < out->len && !(out->stop && *out->stop))
+	{
+		size_t len = out->len - done;
+		if (out->rate)
+		{
+			out_pace(out);
+			len = len < out->chunk ? len : out->chunk;
+		}
+
+		out_expired = 0;
+		if (out->wait)
+		{
+			struct pollfd pfds[2] = {
+				{ .fd = out->fd, .events = POLLOUT },
+				{ .fd = out->stop ? out->peer : -1, .events = POLLIN }
+			};
+			int r = poll(pfds, 2, out->wait);
+			if (r == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			if (pfds[1].revents || r == 0)
+			{
+				if (out->stop)
+				{
+					*out->stop = pfds[1].revents ? SIGHUP : SIGPIPE;
+				}
+				break;
+			}
+
+			struct itimerval it = { .it_value = { .tv_sec = out->wait / 1000, 
+				.tv_usec = out->wait % 1000 * 1000 } };
+			setitimer(ITIMER_REAL, &it, NULL);
+		}
+		ssize_t n = write(out->fd, out->buf + done, len);
+		int err = errno;
+		if (out->wait)
+		{
+			struct itimerval off = { 0 };
+			setitimer(ITIMER_REAL, &off, NULL);
+		}
+		if (out->stats)
+		{
+			++out->stats->writes;
+		}
+		if (n == -1)
+		{
+			if (err == EAGAIN || err == EWOULDBLOCK)
+			{
+				struct pollfd pfd = { .fd = out->fd, .events = POLLOUT };
+				out_expired = poll(&pfd, 1, out->wait ? out->wait : -1) == 0;
+			}
+			if (out_expired)
+			{
+				if (out->stop)
+				{
+					*out->stop = SIGPIPE;
+				}
+				break;
+			}
+			if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
+			{
+				continue;
+			}
+			out->len = 0;
+			return -1;
+		}
+		done += n;
+		out->paced += n;
+	}
+
+	int err = done < out->len ? -1 : 0;
+	out->len = 0;
+	return err;
 }
 
 /*
- * Make sure the terminal goes back to its normal state.
+ * Add `len` bytes to the output buffer, flushing it first if need be.
  */
 static void
-term_reset()
-{
-	fputws(ANSI_FONT_RESET, stdout);   // resets font colors and effects
-	fputws(ANSI_SHOW_CURSOR, stdout);  // show the cursor again
-	term_echo(1);                      // show keyboard input
-}
-
-static void 
-print_color_4bit(nuru_cell_s* cell, uint8_t fg_key, uint8_t bg_key)
+out_bytes(output_s *out, const char *bytes, size_t len)
 {
-	if (cell->fg != fg_key)
+	if (out->len + len > OUT_BUF_SIZE)
 	{
-		// 0 =>  30, 1 =>  31, ...  7 =>  37
-		// 8 =>  90, 8 =>  91, ... 15 =>  97
-		uint8_t col = (cell->fg < 8 ? cell->fg + 30 : cell->fg + 82);
-		wprintf(L"\x1b[%hhum", col);
+		out_flush(out);
 	}
-	if (cell->bg != bg_key)
+	memcpy(out->buf + out->len, bytes, len);
+	out->len += len;
+
+	if (out->stats)
 	{
-		// 0 =>  40, 1 =>  41, ...  7 =>  47
-		// 8 => 100, 9 => 101, ... 15 => 107
-		uint8_t col = (cell->bg < 8 ? cell->bg + 30 : cell->bg + 82) + 10;
-		wprintf(L"\x1b[%hhum", col);
+		out->stats->out_bytes += len;
 	}
 }
 
+/*
+ * Add an escape sequence, given as printf-style format string, to the output.
+ */
 static void
-print_color_8bit(nuru_cell_s* cell, uint8_t fg_key, uint8_t bg_key)
+out_esc(output_s *out, const char *fmt, ...)
 {
-	if (cell->fg != fg_key)
+	char esc[ANSI_SGR_MAX + 8];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(esc, sizeof(esc), fmt, args);
+	va_end(args);
+
+	if (len < 0)
+	{
+		return;
+	}
+	if (len >= (int) sizeof(esc))
 	{
-		wprintf(L"\x1b[38;5;%hhum", cell->fg);
+		len = sizeof(esc) - 1;
 	}
-	if (cell->bg != bg_key)
+	out_bytes(out, esc, len);
+
+	if (out->stats)
 	{
-		wprintf(L"\x1b[48;5;%hhum", cell->bg);
+		out->stats->esc_bytes += len;
 	}
 }
 
+/*
+ * Add a glyph to the output, encoded according to the current locale.
+ */
 static void
-print_color_pal(nuru_cell_s *cell, uint8_t fg_key, uint8_t bg_key, nuru_pal_s* pal)
+out_glyph(output_s *out, wchar_t ch)
 {
-	if (cell->fg != fg_key)
-	{
-		if (pal->type == NURU_PAL_TYPE_COLOR_8BIT)
-		{
-			uint8_t col = nuru_pal_get_col_8bit(pal, cell->fg);
-			wprintf(L"\x1b[38;5;%hhum", col);
-		}
+	char mb[MB_LEN_MAX];
+	mbstate_t ps = { 0 };
+	size_t len = wcrtomb(mb, ch, &ps);
 
-		else if (pal->type == NURU_PAL_TYPE_COLOR_RGB)
-		{
-			nuru_rgb_s* rgb = nuru_pal_get_col_rgb(pal, cell->fg);
-			wprintf(L"\x1b[38;2;%hhu;%hhu;%hhum", rgb->r, rgb->g, rgb->b);
-		}
+	if (len == (size_t) -1)
+	{
+		mb[0] = '?';
+		len = 1;
 	}
+	out_bytes(out, mb, len);
 
-	if (cell->bg != bg_key)
+	if (out->stats)
 	{
-		if (pal->type == NURU_PAL_TYPE_COLOR_8BIT)
-		{
-			uint8_t col = nuru_pal_get_col_8bit(pal, cell->bg);
-			wprintf(L"\x1b[48;5;%hhum", col);
-		}
-
-		else if (pal->type == NURU_PAL_TYPE_COLOR_RGB)
-		{
-			nuru_rgb_s* rgb = nuru_pal_get_col_rgb(pal, cell->bg);
-			wprintf(L"\x1b[48;2;%hhu;%hhu;%hhum", rgb->r, rgb->g, rgb->b);
-		}
+		out->stats->glyph_bytes += len;
 	}
 }
 
+/*
+ * Clear the entire terminal and move the cursor back to the top left.
+ */
 static void
-print_glyph_none()
+term_clear(output_s *out)
 {
-	wchar_t space = NURU_SPACE;
-	fputwc(space, stdout);
+	out_esc(out, ANSI_CLEAR_SCREEN);
+	out_esc(out, ANSI_CURSOR_RESET);
 }
 
+/*
+ * Start a frame: if the terminal supports synchronized output, it doesn't 
+ * paint anything until the frame has ended, so partial frames never show.
+ */
 static void
-print_glyph_ascii(nuru_cell_s* cell, uint8_t ch_key)
+term_sync_begin(output_s *out)
 {
-	if (cell->ch == ch_key)
+	if (out->sync)
 	{
-		print_glyph_none();
-		return;
+		out_esc(out, ANSI_SYNC_BEGIN);
 	}
-	fputwc((wchar_t) cell->ch, stdout);
 }
 
+/*
+ * End a frame, see term_sync_begin(). Should come before out_flush().
+ */
 static void
-print_glyph_unicode(nuru_cell_s* cell, uint8_t ch_key)
+term_sync_end(output_s *out)
 {
-	if (cell->ch == ch_key)
+	if (out->sync)
 	{
-		print_glyph_none();
-		return;
+		out_esc(out, ANSI_SYNC_END);
 	}
-	fputwc((wchar_t) cell->ch, stdout);
 }
 
+/*
+ * Remember which signal asked us to stop; out_flush() and the main loop 
+ * take it from there, so that term_reset() still gets to run.
+ */
 static void
-print_glyph_pal(nuru_cell_s* cell, uint8_t ch_key, nuru_pal_s* nug)
+on_signal(int sig)
 {
-	if (cell->ch == ch_key)
-	{
-		print_glyph_none();
-		return;
-	}
-	wchar_t ch = nuru_pal_get_glyph(nug, cell->ch);
-	fputwc((wchar_t) ch, stdout);
+	stop_signal = sig;
 }
 
-static int
-print_nui(nuru_img_s *nui, nuru_pal_s *nug, nuru_pal_s *nuc, uint16_t cols, uint16_t rows)
+/*
+ * A write() took longer than the output's max wait, see out_flush(). This 
+ * relies on no other threads being around to catch the signal instead, 
+ * which holds as prefetching is off whenever there's a max wait.
+ */
+static void
+on_alarm(int sig)
 {
-	nuru_cell_s *cell = NULL;
+	(void) sig;
+	out_expired = 1;
+}
 
-	for (uint16_t r = 0; r < nui->rows && r < rows; ++r)
-	{
-		for (uint16_t c = 0; c < nui->cols && c < cols; ++c)
-		{
-			cell = nuru_img_get_cell(nui, c, r);
+/*
+ * Prepare the terminal for our matrix shenanigans. SIGINT, SIGTERM and SIGHUP 
+ * stop the output, rather than the process, interrupting a blocked write(), 
+ * so even a congested terminal gets reset promptly. The descriptor itself 
+ * stays blocking, as its flags are shared with stderr and whoever else 
+ * has the same terminal open.
+ */
+static void
+term_setup(output_s *out, options_s *opts, term_caps_s *caps)
+{
+	out->sync = caps->sync;
+	out->alt = opts->alt_screen;
 
-			switch (nui->color_mode)
-			{
-				case NURU_COLOR_MODE_NONE:
-					break;
-				case NURU_COLOR_MODE_4BIT:
-					print_color_4bit(cell, nui->fg_key, nui->bg_key);
-					break;
-				case NURU_COLOR_MODE_8BIT:
-					print_color_8bit(cell, nui->fg_key, nui->bg_key);
-					break;
-				case NURU_COLOR_MODE_PALETTE:
-					print_color_pal(cell, nui->fg_key, nui->bg_key, nuc);
-					break;	
-			}
+	out->rate = opts->rate;
+	out->chunk = opts->rate / OUT_PACE_SLICE;
+	out->chunk = out->chunk < 1 ? 1 : out->chunk > OUT_CHUNK_MAX ? OUT_CHUNK_MAX : out->chunk;
+	out->paced_ns = nuru_time_ns();
+	out->paced = 0;
 
-			switch (nui->glyph_mode)
-			{
-				case NURU_GLYPH_MODE_NONE:
-					print_glyph_none();
-					break;
-				case NURU_GLYPH_MODE_ASCII:
-					print_glyph_ascii(cell, nui->ch_key);
-					break;
-				case NURU_GLYPH_MODE_UNICODE:
-					print_glyph_unicode(cell, nui->ch_key);
-					break;
-				case NURU_GLYPH_MODE_PALETTE:
-					print_glyph_pal(cell, nui->ch_key, nug);
-					break;
-			}
-			fputws(ANSI_FONT_RESET, stdout);
-		}	
-		fputwc('\n', stdout);
+	// no SA_RESTART, so that signals interrupt a blocked poll() or write()
+	stop_signal = 0;
+	out->stop = &stop_signal;
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &out->sig_old[0]);
+	sigaction(SIGTERM, &sa, &out->sig_old[1]);
+	sigaction(SIGHUP, &sa, &out->sig_old[2]);
+	if (out->wait)
+	{
+		sa.sa_handler = on_alarm;
+		sigaction(SIGALRM, &sa, &out->sig_old[3]);
 	}
-	
-	return -1;
+
+	if (out->alt) out_esc(out, ANSI_ALT_SCREEN);
+	out_esc(out, ANSI_HIDE_CURSOR);
+	term_echo(0);                      // don't show keyboard input
+	if (opts->clear) term_clear(out);  // if requested, clear terminal
 }
 
-void
-make_lower(char *str)
+/*
+ * Make sure the terminal goes back to its normal state. If we were stopped 
+ * by a signal, output might have been cut off in the middle of an escape 
+ * sequence, so that gets cancelled first, or of a synchronized frame, which 
+ * gets ended; output still queued up for the terminal is dropped, too. Our 
+ * signal handlers go first, so that a second Ctrl-C gets through even if 
+ * the terminal is slow to take the reset.
+ */
+static void
+term_reset(output_s *out)
 {
-	for (int i = 0; str[i]; ++i)
+	uint8_t stopped = out->stop && *out->stop;
+	out->stop = NULL;
+	out->rate = 0;
+
+	// from here on, another signal does what it would normally do
+	sigaction(SIGINT, &out->sig_old[0], NULL);
+	sigaction(SIGTERM, &out->sig_old[1], NULL);
+	sigaction(SIGHUP, &out->sig_old[2], NULL);
+
+	if (stopped)
 	{
-		str[i] = tolower(str[i]);
+		tcflush(out->fd, TCOFLUSH);    // drop what's still queued up
+		out->len = 0;
+		out_bytes(out, ANSI_CANCEL, 1);
+		term_sync_end(out);
+	}
+	out_esc(out, ANSI_FONT_RESET);     // resets font colors and effects
+	out_esc(out, ANSI_SHOW_CURSOR);    // show the cursor again
+	if (out->alt) out_esc(out, ANSI_MAIN_SCREEN);
+	term_echo(1);                      // show keyboard input
+	out_flush(out);
+
+	if (out->wait)
+	{
+		sigaction(SIGALRM, &out->sig_old[3], NULL);
 	}
 }
 
-int
-pal_path(char *buf, size_t len, const char *pal, const char *type)
+/*
+ * Make an educated guess about the terminal's color depth, based on the 
+ * environment variables COLORTERM and TERM alone.
+ */
+static uint8_t
+term_depth_env()
 {
-	char *home = getenv("HOME");
-	char *config = getenv("XDG_CONFIG_HOME");
+	char *colorterm = getenv("COLORTERM");
+	char *term = getenv("TERM");
 
-	if (config)
+	if (colorterm && (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit")))
 	{
-		return snprintf(buf, len, "%s/%s/%s/%s.%s", 
-				config, 
-				PROJECT_NAME, 
-				type, 
-				pal, 
-				NURU_PAL_FILEEXT
-		);
+		return TERM_DEPTH_24BIT;
 	}
-	else
+	if (term == NULL || term[0] == '\0' || !strcmp(term, "dumb"))
 	{
-		return snprintf(buf, len, "%s/%s/%s/%s/%s.%s", 
-				home, 
-				".config", 
-				PROJECT_NAME, 
-				type, 
-				pal, 
-				NURU_PAL_FILEEXT
+		return TERM_DEPTH_NONE;
+	}
+	if (strstr(term, "-direct"))
+	{
+		return TERM_DEPTH_24BIT;
+	}
+	if (strstr(term, "256col"))
+	{
+		return TERM_DEPTH_8BIT;
+	}
+	return TERM_DEPTH_4BIT;
+}
+
+/*
+ * Ask the terminal `tty` about its capabilities via XTGETTCAP and whether it 
+ * knows synchronized output via DECRQM, followed by a DA1 request. Every 
+ * terminal answers the latter, so once the DA1 response has arrived, we know 
+ * that there won't be any other responses coming our way. Only ever upgrades 
+ * the color depth found in `caps`. Returns 0 if the terminal responded, -1 
+ * otherwise.
+ */
+static int
+term_query(term_caps_s *caps, const char *tty)
+{
+	int fd = open(tty, O_RDWR | O_NOCTTY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	struct termios ta_old, ta_raw;
+	if (tcgetattr(fd, &ta_old) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	ta_raw = ta_old;
+	ta_raw.c_lflag &= ~(ICANON | ECHO);
+	ta_raw.c_cc[VMIN] = 0;
+	ta_raw.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &ta_raw);
+
+	char query[] = QUERY_XTGETTCAP QUERY_DECRQM_SYNC QUERY_DA1;
+	if (write(fd, query, sizeof(query) - 1) == -1)
+	{
+		tcsetattr(fd, TCSANOW, &ta_old);
+		close(fd);
+		return -1;
+	}
+
+	char buf[512] = { 0 };
+	size_t len = 0;
+	char *da1 = NULL;
+	uint8_t answered = 0;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while (len < sizeof(buf) - 1 && poll(&pfd, 1, QUERY_TIMEOUT) > 0)
+	{
+		ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (n <= 0)
+		{
+			break;
+		}
+		len += n;
+		buf[len] = '\0';
+
+		// DA1 response looks like "ESC [ ? 6 2 ; 2 2 c"
+		if ((da1 = strstr(buf, "\x1b[?")) && strchr(da1, 'c'))
+		{
+			answered = 1;
+			break;
+		}
+	}
+
+	// a slow terminal's replies mustn't end up as input to the shell
+	if (!answered)
+	{
+		tcflush(fd, TCIFLUSH);
+	}
+	tcsetattr(fd, TCSANOW, &ta_old);
+	close(fd);
+
+	// DECRPM response looks like "ESC [ ? 2 0 2 6 ; 1 $ y", where the mode's 
+	// state is 1 (set) or 2 (reset) if supported, 0 or 4 if not
+	char *sync = strstr(buf, "\x1b[?2026;");
+	caps->sync = sync && (sync[8] == '1' || sync[8] == '2') && sync[9] == '$';
+
+	// "RGB" capability present, the terminal does direct colors
+	if (strstr(buf, "1+r524742"))
+	{
+		caps->depth = TERM_DEPTH_24BIT;
+	}
+
+	// "colors" capability, the value is a hex-encoded decimal string
+	char *colors = strstr(buf, "1+r636f6c6f7273=");
+	if (colors && caps->depth < TERM_DEPTH_24BIT)
+	{
+		unsigned long num = 0;
+		unsigned int ch = 0;
+		colors += strlen("1+r636f6c6f7273=");
+		while (sscanf(colors, "%2x", &ch) == 1 && isdigit(ch))
+		{
+			num = (num * 10) + (ch - '0');
+			colors += 2;
+		}
+		if (num >= 16777216)
+		{
+			caps->depth = TERM_DEPTH_24BIT;
+		}
+		else if (num >= 256 && caps->depth < TERM_DEPTH_8BIT)
+		{
+			caps->depth = TERM_DEPTH_8BIT;
+		}
+		else if (num >= 8 && caps->depth < TERM_DEPTH_4BIT)
+		{
+			caps->depth = TERM_DEPTH_4BIT;
+		}
+	}
+
+	return da1 ? 0 : -1;
+}
+
+/*
+ * Put the path to the capability cache file for the given TERM into `buf`.
+ */
+static int
+caps_path(char *buf, size_t len, const char *term)
+{
+	char *home = getenv("HOME");
+	char *cache = getenv("XDG_CACHE_HOME");
+
+	// TERM ends up as a file name, so it better not be a path
+	char name[NAME_MAX + 1];
+	snprintf(name, sizeof(name), "%s", term);
+	for (char *c = name; *c; ++c)
+	{
+		if (*c == '/' || (*c == '.' && c == name))
+		{
+			*c = '_';
+		}
+	}
+
+	if (cache)
+	{
+		return snprintf(buf, len, "%s/%s/%s/%s", 
+				cache, 
+				PROJECT_NAME, 
+				"term", 
+				name
+		);
+	}
+	else
+	{
+		return snprintf(buf, len, "%s/%s/%s/%s/%s", 
+				home, 
+				".cache", 
+				PROJECT_NAME, 
+				"term", 
+				name
 		);
 	}
 }
 
-int
-load_pal_by_name(nuru_pal_s *nup, const char *type, const char *name)
+/*
+ * Create all directories leading up to the file given by `path`.
+ */
+static int
+make_dirs(const char *path)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, PATH_MAX, "%s", path);
+
+	for (char *c = dir + 1; *c; ++c)
+	{
+		if (*c != '/')
+		{
+			continue;
+		}
+		*c = '\0';
+		if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		{
+			return -1;
+		}
+		*c = '/';
+	}
+	return 0;
+}
+
+/*
+ * Read cached terminal capabilities from the given file.
+ */
+static int
+caps_load(term_caps_s *caps, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	int found = 0;
+	char line[64];
+	while (fgets(line, sizeof(line), fp))
+	{
+		found += sscanf(line, "depth=%hhu", &caps->depth);
+		found += sscanf(line, "sync=%hhu", &caps->sync);
+	}
+
+	// files written before `sync` was a thing don't count, query again
+	fclose(fp);
+	return found == 2 ? 0 : -1;
+}
+
+/*
+ * Write terminal capabilities to the given cache file.
+ */
+static int
+caps_save(term_caps_s *caps, const char *path)
+{
+	if (make_dirs(path) == -1)
+	{
+		return -1;
+	}
+
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	fprintf(fp, "depth=%hhu\n", caps->depth);
+	fprintf(fp, "sync=%hhu\n", caps->sync);
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Figure out what the terminal can do. The environment is cheap to inspect, 
+ * so that's where we start. As it doesn't tell us about synchronized output, 
+ * we then use the info cached for this TERM or, if there is none or `probe` 
+ * is set, query the terminal and cache the result, as the query can take a 
+ * while. Terminals without colors (or dumb ones) aren't bothered at all.
+ */
+static void
+term_caps(term_caps_s *caps, uint8_t probe, const char *tty)
+{
+	caps->depth = term_depth_env();
+	caps->sync = 0;
+	if (caps->depth == TERM_DEPTH_NONE)
+	{
+		return;
+	}
+
+	char path[PATH_MAX];
+	caps_path(path, PATH_MAX, getenv("TERM"));
+
+	term_caps_s cached = { 0 };
+	if (!probe && caps_load(&cached, path) == 0)
+	{
+		if (cached.depth > caps->depth)
+		{
+			caps->depth = cached.depth;
+		}
+		caps->sync = cached.sync;
+		return;
+	}
+
+	// only cache what the terminal said, COLORTERM may differ next time
+	term_caps_s queried = { 0 };
+	if (term_query(&queried, tty) == 0)
+	{
+		caps_save(&queried, path);
+	}
+	if (queried.depth > caps->depth)
+	{
+		caps->depth = queried.depth;
+	}
+	caps->sync = queried.sync;
+}
+
+/*
+ * Same as term_caps(), but remembers the result for every type of terminal 
+ * (TERM and COLORTERM) seen so far, which saves the daemon from reading the 
+ * cache file, or even querying the terminal, on every request.
+ */
+static void
+term_caps_cached(state_s *state)
+{
+	caps_cache_s *cache = &state->terms;
+	char *term = getenv("TERM");
+	char *colorterm = getenv("COLORTERM");
+
+	char key[sizeof(cache->keys[0])];
+	snprintf(key, sizeof(key), "%s/%s", term ? term : "", colorterm ? colorterm : "");
+
+	size_t num = cache->num < CAPS_CACHE_SIZE ? cache->num : CAPS_CACHE_SIZE;
+	for (size_t i = 0; i < num && !state->opts->probe; ++i)
+	{
+		if (strcmp(cache->keys[i], key) == 0)
+		{
+			state->caps = cache->caps[i];
+			return;
+		}
+	}
+
+	term_caps(&state->caps, state->opts->probe, state->tty);
+
+	size_t idx = cache->num % CAPS_CACHE_SIZE;
+	cache->caps[idx] = state->caps;
+	strcpy(cache->keys[idx], key);
+	++cache->num;
+}
+
+/*
+ * Resolve a cell's color value into an actual color, based on the image's
+ * color mode. Transparent (key) colors are resolved to "no color".
+ */
+static void
+cell_color(nuru_img_s *nui, nuru_pal_s *nuc, uint8_t val, uint8_t key, color_s *col)
+{
+	col->depth = TERM_DEPTH_NONE;
+	if (val == key)
+	{
+		return;
+	}
+
+	switch (nui->color_mode)
+	{
+		case NURU_COLOR_MODE_4BIT:
+			col->depth = TERM_DEPTH_4BIT;
+			col->idx = val;
+			break;
+		case NURU_COLOR_MODE_8BIT:
+			col->depth = TERM_DEPTH_8BIT;
+			col->idx = val;
+			break;
+		case NURU_COLOR_MODE_PALETTE:
+			if (nuc->type == NURU_PAL_TYPE_COLOR_8BIT)
+			{
+				col->depth = TERM_DEPTH_8BIT;
+				col->idx = nuru_pal_get_col_8bit(nuc, val);
+			}
+			else if (nuc->type == NURU_PAL_TYPE_COLOR_RGB)
+			{
+				col->depth = TERM_DEPTH_24BIT;
+				col->rgb = *nuru_pal_get_col_rgb(nuc, val);
+			}
+			break;
+	}
+}
+
+/*
+ * Convert the given color to the closest one available in the given depth.
+ */
+static void
+color_fit(color_s *col, uint8_t depth)
+{
+	if (col->depth <= depth)
+	{
+		return;
+	}
+
+	if (depth == TERM_DEPTH_NONE)
+	{
+		col->depth = TERM_DEPTH_NONE;
+		return;
+	}
+
+	if (col->depth == TERM_DEPTH_24BIT)
+	{
+		col->idx = depth == TERM_DEPTH_8BIT ?
+			nuru_rgb_to_ansi_8bit(&col->rgb) :
+			nuru_rgb_to_ansi_4bit(&col->rgb);
+		col->depth = depth;
+		return;
+	}
+
+	// 8 bit to 4 bit, where the first 16 colors are the 4 bit colors
+	if (col->idx >= 16)
+	{
+		nuru_rgb_s rgb;
+		nuru_ansi_to_rgb(col->idx, &rgb);
+		col->idx = nuru_rgb_to_ansi_4bit(&rgb);
+	}
+	col->depth = TERM_DEPTH_4BIT;
+}
+
+/*
+ * Bring the color into its shortest equivalent form: 8 bit colors 0..15 are 
+ * the 4 bit colors and RGB values that are part of the 8 bit color cube or 
+ * grayscale ramp can be sent as 8 bit color instead.
+ */
+static void
+color_norm(color_s *col)
+{
+	if (col->depth == TERM_DEPTH_24BIT)
+	{
+		nuru_rgb_s rgb;
+		uint8_t idx = nuru_rgb_to_ansi_8bit(&col->rgb);
+		nuru_ansi_to_rgb(idx, &rgb);
+		if (nuru_rgb_dist(&rgb, &col->rgb) == 0)
+		{
+			col->depth = TERM_DEPTH_8BIT;
+			col->idx = idx;
+		}
+	}
+	if (col->depth == TERM_DEPTH_8BIT && col->idx < 16)
+	{
+		col->depth = TERM_DEPTH_4BIT;
+	}
+}
+
+/*
+ * Check if two (normalized) colors will look the same in the terminal.
+ */
+static int
+color_same(color_s *a, color_s *b)
+{
+	if (a->depth != b->depth)
+	{
+		return 0;
+	}
+	switch (a->depth)
+	{
+		case TERM_DEPTH_4BIT:
+		case TERM_DEPTH_8BIT:
+			return a->idx == b->idx;
+		case TERM_DEPTH_24BIT:
+			return nuru_rgb_dist(&a->rgb, &b->rgb) == 0;
+	}
+	return 1;
+}
+
+/*
+ * Write the SGR parameter(s) for the given (normalized) color to `buf`.
+ * Returns the number of chars written, as snprintf() would.
+ */
+static int
+sgr_color(char *buf, size_t len, color_s *col, uint8_t bg)
+{
+	switch (col->depth)
+	{
+		case TERM_DEPTH_4BIT:
+			// 0 =>  30, 1 =>  31, ...  7 =>  37
+			// 8 =>  90, 9 =>  91, ... 15 =>  97
+			// background colors are the same, plus 10
+			return snprintf(buf, len, "%d", 
+					(col->idx < 8 ? col->idx + 30 : col->idx + 82) + (bg ? 10 : 0));
+		case TERM_DEPTH_8BIT:
+			return snprintf(buf, len, "%c8;5;%hhu", bg ? '4' : '3', col->idx);
+		case TERM_DEPTH_24BIT:
+			return snprintf(buf, len, "%c8;2;%hhu;%hhu;%hhu", bg ? '4' : '3', 
+					col->rgb.r, col->rgb.g, col->rgb.b);
+		default:
+			return snprintf(buf, len, "%c9", bg ? '4' : '3');
+	}
+}
+
+/*
+ * Put the SGR parameters that take the text attributes from `from` to `to` 
+ * into `buf`, separated by semicolons: first those turning attributes off, 
+ * then those turning them on. As there is no code that turns off only bold 
+ * or only faint, 22 turns off both, so the one to keep is turned on again.
+ */
+static int
+sgr_attrs(char *buf, size_t len, uint8_t from, uint8_t to)
+{
+	// SGR codes turning NURU_MD_BOLD, _FAINT, ... on and off, bit by bit
+	static const uint8_t code_on[]  = {  1,  2,  3,  4,  5,  7 };
+	static const uint8_t code_off[] = { 22, 22, 23, 24, 25, 27 };
+
+	uint8_t off = from & ~to;
+	uint8_t on = to & ~from;
+	if (off & (NURU_MD_BOLD | NURU_MD_FAINT))
+	{
+		off = (off & ~NURU_MD_FAINT) | NURU_MD_BOLD;  // one 22 will do
+		on |= to & (NURU_MD_BOLD | NURU_MD_FAINT);
+	}
+
+	int n = 0;
+	for (int i = 0; i < 6; ++i)
+	{
+		if (off & (1 << i))
+		{
+			n += snprintf(buf + n, len - n, "%s%hhu", n ? ";" : "", code_off[i]);
+		}
+	}
+	for (int i = 0; i < 6; ++i)
+	{
+		if (on & (1 << i))
+		{
+			n += snprintf(buf + n, len - n, "%s%hhu", n ? ";" : "", code_on[i]);
+		}
+	}
+	return n;
+}
+
+/*
+ * Bring the terminal from the state in `pen` to the given colors and text 
+ * attributes (NURU_MD_* bits), using a single SGR sequence that only contains 
+ * the parameters that changed. If the target state is the default state, a 
+ * plain reset is all that's needed. Passing NULL for `fg` leaves the 
+ * foreground color as is.
+ */
+static void
+print_sgr(output_s *out, color_s *fg, color_s *bg, uint8_t attrs)
+{
+	pen_s *pen = &out->pen;
+	uint8_t set_fg = fg && !color_same(&pen->fg, fg);
+	uint8_t set_bg = !color_same(&pen->bg, bg);
+	uint8_t set_attrs = pen->attrs != attrs;
+
+	if (!set_fg && !set_bg && !set_attrs)
+	{
+		return;
+	}
+
+	if ((fg == NULL || fg->depth == TERM_DEPTH_NONE) && bg->depth == TERM_DEPTH_NONE && !attrs)
+	{
+		out_esc(out, "\x1b[m");
+		if (out->stats)
+		{
+			++out->stats->sgr_changes;
+		}
+		pen->fg.depth = TERM_DEPTH_NONE;
+		pen->bg.depth = TERM_DEPTH_NONE;
+		pen->attrs = 0;
+		return;
+	}
+
+	char params[ANSI_SGR_MAX];
+	int len = 0;
+
+	if (set_attrs)
+	{
+		len += sgr_attrs(params, sizeof(params), pen->attrs, attrs);
+		pen->attrs = attrs;
+	}
+	if (set_fg)
+	{
+		len += snprintf(params + len, sizeof(params) - len, "%s", len ? ";" : "");
+		len += sgr_color(params + len, sizeof(params) - len, fg, 0);
+		pen->fg = *fg;
+	}
+	if (set_bg)
+	{
+		len += snprintf(params + len, sizeof(params) - len, "%s", len ? ";" : "");
+		len += sgr_color(params + len, sizeof(params) - len, bg, 1);
+		pen->bg = *bg;
+	}
+	out_esc(out, "\x1b[%sm", params);
+	if (out->stats)
+	{
+		++out->stats->sgr_changes;
+	}
+}
+
+static wchar_t
+glyph_none()
+{
+	return NURU_SPACE;
+}
+
+static wchar_t
+glyph_ascii(nuru_cell_s* cell, uint8_t ch_key)
+{
+	if (cell->ch == ch_key)
+	{
+		return glyph_none();
+	}
+	return (wchar_t) cell->ch;
+}
+
+static wchar_t
+glyph_unicode(nuru_cell_s* cell, uint8_t ch_key)
+{
+	if (cell->ch == ch_key)
+	{
+		return glyph_none();
+	}
+	return (wchar_t) cell->ch;
+}
+
+static wchar_t
+glyph_pal(nuru_cell_s* cell, uint8_t ch_key, nuru_pal_s* nug)
+{
+	if (cell->ch == ch_key)
+	{
+		return glyph_none();
+	}
+	return (wchar_t) nuru_pal_get_glyph(nug, cell->ch);
+}
+
+/*
+ * Move the cursor `n` cells to the right, without touching those cells.
+ */
+static void
+print_skip(output_s *out, int n)
+{
+	if (n == 1)
+	{
+		out_esc(out, ANSI_CURSOR_RIGHT);
+	}
+	else if (n > 1)
+	{
+		out_esc(out, ANSI_CURSOR_RIGHT_N, n);
+	}
+}
+
+/*
+ * Print the part of the image that falls into the given area of the terminal,
+ * the image's top left cell being the terminal's. Unless `area->place` is 
+ * set, printing starts wherever the cursor is, with line breaks after rows.
+ */
+static int
+print_nui(output_s *out, nuru_img_s *nui, nuru_pal_s *nug, nuru_pal_s *nuc, term_caps_s *caps, options_s *opts, area_s *area)
+{
+	nuru_cell_s *cell = NULL;
+	wchar_t ch = NURU_SPACE;
+	color_s fg = { 0 };
+	color_s bg = { 0 };
+	uint8_t attrs = 0;
+	int skip = 0;
+
+	uint32_t col_end = (uint32_t) area->col + area->cols;
+	uint32_t row_end = (uint32_t) area->row + area->rows;
+	for (uint16_t r = area->row; r < nui->rows && r < row_end; ++r)
+	{
+		if (area->place)
+		{
+			out_esc(out, ANSI_CURSOR_MOVE, r + 1, area->col + 1);
+		}
+		skip = 0;
+		for (uint16_t c = area->col; c < nui->cols && c < col_end; ++c)
+		{
+			cell = nuru_img_get_cell(nui, c, r);
+			cell_color(nui, nuc, cell->bg, nui->bg_key, &bg);
+			attrs = nui->mdata_mode ? cell->md & NURU_MD_ATTRS : 0;
+
+			// in overlay mode, fully transparent cells are skipped over
+			if (opts->overlay && bg.depth == TERM_DEPTH_NONE && !(attrs & ATTRS_SPACE) &&
+					(nui->glyph_mode == NURU_GLYPH_MODE_NONE || cell->ch == nui->ch_key))
+			{
+				++skip;
+				continue;
+			}
+			print_skip(out, skip);
+			skip = 0;
+
+			switch (nui->glyph_mode)
+			{
+				case NURU_GLYPH_MODE_NONE:
+					ch = glyph_none();
+					break;
+				case NURU_GLYPH_MODE_ASCII:
+					ch = glyph_ascii(cell, nui->ch_key);
+					break;
+				case NURU_GLYPH_MODE_UNICODE:
+					ch = glyph_unicode(cell, nui->ch_key);
+					break;
+				case NURU_GLYPH_MODE_PALETTE:
+					ch = glyph_pal(cell, nui->ch_key, nug);
+					break;
+			}
+
+			cell_color(nui, nuc, cell->fg, nui->fg_key, &fg);
+			color_fit(&fg, caps->depth);
+			color_fit(&bg, caps->depth);
+			color_norm(&fg);
+			color_norm(&bg);
+
+			// neither the foreground color nor most attributes matter for 
+			// spaces, so whatever is set stays set, unless they're reversed 
+			// or underlined, as both show the foreground color
+			if (ch == NURU_SPACE)
+			{
+				attrs = (attrs & ATTRS_SPACE) | (out->pen.attrs & ~ATTRS_SPACE);
+			}
+			print_sgr(out, ch == NURU_SPACE && !(attrs & ATTRS_SPACE) ? NULL : &fg, &bg, attrs);
+			out_glyph(out, ch);
+
+			if (out->stats)
+			{
+				++out->stats->cells;
+			}
+		}
+
+		// reset before the line break, lest the background color bleeds
+		fg.depth = TERM_DEPTH_NONE;
+		bg.depth = TERM_DEPTH_NONE;
+		print_sgr(out, &fg, &bg, 0);
+		if (!area->place)
+		{
+			out_glyph(out, '\n');
+		}
+	}
+	
+	return -1;
+}
+
+/*
+ * Print an image that has no glyphs (NURU_GLYPH_MODE_NONE) as a bitmap, where 
+ * every cell's background color is a pixel. Two pixels, stacked vertically, 
+ * are printed into one terminal cell, using the upper or lower half-block 
+ * glyph and both foreground and background color. This halves the number of 
+ * rows printed. The area is given in terminal rows, see print_nui().
+ */
+static int
+print_nui_px(output_s *out, nuru_img_s *nui, nuru_pal_s *nuc, term_caps_s *caps, options_s *opts, area_s *area)
+{
+	color_s top = { 0 };
+	color_s bot = { 0 };
+	color_s none = { 0 };
+	int skip = 0;
+
+	uint32_t col_end = (uint32_t) area->col + area->cols;
+	uint32_t row_end = ((uint32_t) area->row + area->rows) * 2;
+	for (uint32_t r = area->row * 2u; r < nui->rows && r < row_end; r += 2)
+	{
+		if (area->place)
+		{
+			out_esc(out, ANSI_CURSOR_MOVE, r / 2 + 1, area->col + 1);
+		}
+		skip = 0;
+		for (uint16_t c = area->col; c < nui->cols && c < col_end; ++c)
+		{
+			cell_color(nui, nuc, nuru_img_get_cell(nui, c, r)->bg, nui->bg_key, &top);
+			bot.depth = TERM_DEPTH_NONE;
+			if (r + 1 < nui->rows)
+			{
+				cell_color(nui, nuc, nuru_img_get_cell(nui, c, r + 1)->bg, nui->bg_key, &bot);
+			}
+
+			// in overlay mode, fully transparent cells are skipped over
+			if (opts->overlay && top.depth == TERM_DEPTH_NONE && bot.depth == TERM_DEPTH_NONE)
+			{
+				++skip;
+				continue;
+			}
+			print_skip(out, skip);
+			skip = 0;
+
+			color_fit(&top, caps->depth);
+			color_fit(&bot, caps->depth);
+			color_norm(&top);
+			color_norm(&bot);
+
+			if (color_same(&top, &bot))
+			{
+				// both pixels the same (or transparent), a space will do
+				print_sgr(out, NULL, &top, 0);
+				out_glyph(out, NURU_SPACE);
+			}
+			else if (top.depth == TERM_DEPTH_NONE)
+			{
+				print_sgr(out, &bot, &none, 0);
+				out_glyph(out, GLYPH_LOWER_HALF);
+			}
+			else if (bot.depth == TERM_DEPTH_NONE)
+			{
+				print_sgr(out, &top, &none, 0);
+				out_glyph(out, GLYPH_UPPER_HALF);
+			}
+			else if (color_same(&out->pen.fg, &bot) || color_same(&out->pen.bg, &top))
+			{
+				// flipping fg and bg means fewer color changes to send
+				print_sgr(out, &bot, &top, 0);
+				out_glyph(out, GLYPH_LOWER_HALF);
+			}
+			else
+			{
+				print_sgr(out, &top, &bot, 0);
+				out_glyph(out, GLYPH_UPPER_HALF);
+			}
+
+			if (out->stats)
+			{
+				++out->stats->cells;
+			}
+		}
+
+		// reset before the line break, lest the background color bleeds
+		print_sgr(out, &none, &none, 0);
+		if (!area->place)
+		{
+			out_glyph(out, '\n');
+		}
+	}
+
+	return -1;
+}
+
+void
+make_lower(char *str)
+{
+	for (int i = 0; str[i]; ++i)
+	{
+		str[i] = tolower(str[i]);
+	}
+}
+
+int
+pal_path(char *buf, size_t len, const char *pal, const char *type)
+{
+	char *home = getenv("HOME");
+	char *config = getenv("XDG_CONFIG_HOME");
+
+	if (config)
+	{
+		return snprintf(buf, len, "%s/%s/%s/%s.%s", 
+				config, 
+				PROJECT_NAME, 
+				type, 
+				pal, 
+				NURU_PAL_FILEEXT
+		);
+	}
+	else
+	{
+		return snprintf(buf, len, "%s/%s/%s/%s/%s.%s", 
+				home, 
+				".config", 
+				PROJECT_NAME, 
+				type, 
+				pal, 
+				NURU_PAL_FILEEXT
+		);
+	}
+}
+
+int
+load_pal_by_name(nuru_pal_s *nup, const char *type, const char *name)
+{
+	// make a copy of the name and lower-case it
+	char pal_name[NURU_STR_LEN];
+	strcpy(pal_name, name);
+	make_lower(pal_name);
+
+	// get the full path to the palette
+	char path[PATH_MAX];
+	pal_path(path, PATH_MAX, pal_name, type);
+
+	// load the palette
+	return nuru_pal_load(nup, path) == 0 ? 0 : -1;
+}
+
+/*
+ * Get the palette of the given type and name, loading it if it hasn't been 
+ * loaded before. When the cache is full, the least recently used palette is 
+ * replaced, so that the other palette of the same image stays put. A palette 
+ * that fails to load leaves the cache as it was.
+ */
+static nuru_pal_s*
+get_pal_by_name(pal_cache_s *cache, const char *type, const char *name)
+{
+	char key[NURU_STR_LEN + 8];
+	snprintf(key, sizeof(key), "%s/%s", type, name);
+
+	// the slot with the same palette or, failing that, the least recently used
+	size_t slot = 0;
+	for (size_t i = 0; i < PAL_CACHE_SIZE; ++i)
+	{
+		if (strcmp(cache->keys[i], key) == 0)
+		{
+			cache->used[i] = ++cache->clock;
+			return &cache->pals[i];
+		}
+		if (cache->used[i] < cache->used[slot])
+		{
+			slot = i;
+		}
+	}
+
+	nuru_pal_s pal = { 0 };
+	if (load_pal_by_name(&pal, type, name) == -1)
+	{
+		return NULL;
+	}
+	cache->pals[slot] = pal;
+	strcpy(cache->keys[slot], key);
+	cache->used[slot] = ++cache->clock;
+	return &cache->pals[slot];
+}
+
+/*
+ * Check if the file is a tiled image, going by its extension.
+ */
+static uint8_t
+is_tiled(const char *file)
+{
+	const char *ext = strrchr(file, '.');
+	return ext && strcmp(ext + 1, NURU_TILE_FILEEXT) == 0;
+}
+
+/*
+ * Read the entire file into memory. Files that aren't regular files, are 
+ * larger than `max_len` or can't be read are left alone, so the regular load 
+ * will deal with (and report) them. Tiled images are read tile by tile.
+ */
+static void
+fetch_file(fetch_s *f, size_t max_len)
+{
+	if (is_tiled(f->file))
+	{
+		return;
+	}
+
+	int fd = open(f->file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && (size_t) sb.st_size <= max_len)
+	{
+		size_t len = sb.st_size;
+		uint8_t *data = malloc(len ? len : 1);
+		size_t done = 0;
+		while (data && done < len)
+		{
+			ssize_t n = read(fd, data + done, len - done);
+			if (n == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			if (n <= 0)
+			{
+				break;
+			}
+			done += n;
+		}
+
+		if (data && done == len)
+		{
+			f->data = data;
+			f->len = len;
+		}
+		else
+		{
+			free(data);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Prefetch worker: reads files as they get queued, until told to quit.
+ */
+static void*
+prefetch_worker(void *arg)
+{
+	prefetch_s *pf = arg;
+	pthread_mutex_lock(&pf->lock);
+	for (;;)
+	{
+		while (pf->next == pf->tail && !pf->quit)
+		{
+			pthread_cond_wait(&pf->work, &pf->lock);
+		}
+		if (pf->quit)
+		{
+			break;
+		}
+		fetch_s *f = &pf->slots[pf->next++ % pf->num_slots];
+
+		pthread_mutex_unlock(&pf->lock);
+		fetch_file(f, pf->max_len);
+		pthread_mutex_lock(&pf->lock);
+
+		f->done = 1;
+		pthread_cond_broadcast(&pf->done);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return NULL;
+}
+
+/*
+ * Start `num` workers, each reading one of up to `num` queued files at a 
+ * time, so that reads that wait on slow storage overlap. Returns -1 if not 
+ * a single worker could be started.
+ */
+static int
+prefetch_init(prefetch_s *pf, int num, size_t max_len)
+{
+	*pf = (prefetch_s) { 0 };
+	pf->num_slots = num < PREFETCH_MAX ? num : PREFETCH_MAX;
+	pf->max_len = max_len;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->work, NULL);
+	pthread_cond_init(&pf->done, NULL);
+
+	for (size_t i = 0; i < pf->num_slots; ++i)
+	{
+		if (pthread_create(&pf->threads[i], NULL, prefetch_worker, pf) != 0)
+		{
+			break;
+		}
+		++pf->num_threads;
+	}
+	return pf->num_threads ? 0 : -1;
+}
+
+static uint8_t
+prefetch_full(prefetch_s *pf)
+{
+	return pf->tail - pf->head == pf->num_slots;
+}
+
+static uint8_t
+prefetch_empty(prefetch_s *pf)
+{
+	return pf->tail == pf->head;
+}
+
+/*
+ * Queue a file to be read. The queue must not be full.
+ */
+static void
+prefetch_push(prefetch_s *pf, const char *file)
+{
+	pthread_mutex_lock(&pf->lock);
+	fetch_s *f = &pf->slots[pf->tail++ % pf->num_slots];
+	*f = (fetch_s) { .file = strdup(file) };
+	f->done = f->file == NULL;
+	pthread_cond_signal(&pf->work);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ * Wait for the oldest queued file to be read, then return it.
+ */
+static fetch_s*
+prefetch_wait(prefetch_s *pf)
+{
+	fetch_s *f = &pf->slots[pf->head % pf->num_slots];
+	pthread_mutex_lock(&pf->lock);
+	while (!f->done)
+	{
+		pthread_cond_wait(&pf->done, &pf->lock);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return f;
+}
+
+/*
+ * Remove the oldest file from the queue, once it has been read.
+ */
+static void
+prefetch_pop(prefetch_s *pf)
+{
+	fetch_s *f = prefetch_wait(pf);
+	free(f->file);
+	free(f->data);
+	*f = (fetch_s) { 0 };
+
+	pthread_mutex_lock(&pf->lock);
+	++pf->head;
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ * Stop the workers and free all files still queued.
+ */
+static void
+prefetch_free(prefetch_s *pf)
+{
+	pthread_mutex_lock(&pf->lock);
+	pf->quit = 1;
+	pthread_cond_broadcast(&pf->work);
+	pthread_mutex_unlock(&pf->lock);
+
+	for (size_t i = 0; i < pf->num_threads; ++i)
+	{
+		pthread_join(pf->threads[i], NULL);
+	}
+	for (; pf->head != pf->tail; ++pf->head)
+	{
+		fetch_s *f = &pf->slots[pf->head % pf->num_slots];
+		free(f->file);
+		free(f->data);
+	}
+
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->work);
+	pthread_cond_destroy(&pf->done);
+}
+
+/*
+ * Check if two stats of a file say it's the very same, unchanged file.
+ */
+static uint8_t
+same_file(struct stat *a, struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Close the tiled image kept open in the state, if any.
+ */
+static void
+close_tiled(state_s *state)
+{
+	if (state->tiled_path)
+	{
+		nuru_tiled_close(&state->tiled);
+		free(state->tiled_path);
+		state->tiled_path = NULL;
+	}
+}
+
+/*
+ * Make sure the tiled image `file` is open in the state. It stays open, so 
+ * that tiles it has decoded already can be used again the next time the 
+ * same file gets loaded: when the terminal grows while holding the image, 
+ * or with the daemon's next request. Another file, or the same one changed 
+ * since, gets opened anew.
+ */
+static int
+open_tiled(state_s *state, const char *file)
+{
+	struct stat sb;
+	char *path = realpath(file, NULL);
+	if (path == NULL || stat(path, &sb) == -1)
+	{
+		free(path);
+		return NURU_ERR_FILE_OPEN;
+	}
+	if (state->tiled_path && strcmp(state->tiled_path, path) == 0 &&
+			same_file(&state->tiled_st, &sb))
+	{
+		free(path);
+		return 0;
+	}
+
+	close_tiled(state);
+	int err = nuru_tiled_open(&state->tiled, path, 0);
+	if (err != 0)
+	{
+		free(path);
+		return err;
+	}
+	state->tiled_path = path;
+	state->tiled_st = sb;
+	return 0;
+}
+
+/*
+ * Load the part of a tiled image that fits the terminal, starting at the 
+ * column and row given via -x and -y, into the state's image. Only the 
+ * tiles overlapping that part are read from the file. The level is the one
+ * given via -z; with -s, it's the smallest one that still has to be scaled 
+ * down to fit, which is then loaded as a whole (see nuru-mip).
+ */
+static int
+load_tiled(state_s *state, const char *file, nuru_stats_s *st)
+{
+	options_s *opts = state->opts;
+	nuru_tiled_s *tiled = &state->tiled;
+
+	uint64_t t0 = nuru_time_ns();
+	int err = open_tiled(state, file);
+	if (err != 0)
+	{
+		return err;
+	}
+	uint64_t t1 = nuru_time_ns();
+
+	// in pixel mode, every terminal row holds two rows of the image
+	uint8_t pixels = opts->pixels && tiled->head.glyph_mode == NURU_GLYPH_MODE_NONE;
+	uint16_t rows = state->ws.ws_row * (pixels ? 2 : 1);
+
+	uint16_t cols = state->ws.ws_col;
+
+	uint8_t level = opts->zoom < tiled->num_levels ? opts->zoom : tiled->num_levels - 1;
+	if (opts->fit)
+	{
+		for (level = tiled->num_levels - 1; level > opts->zoom; --level)
+		{
+			if (tiled->levels[level].cols >= cols || tiled->levels[level].rows >= rows)
+			{
+				break;
+			}
+		}
+	}
+
+	// -x and -y are given in cells of the full size image
+	nuru_tile_level_s *lv = &tiled->levels[level];
+	uint32_t x = opts->view_x >> level;
+	uint32_t y = opts->view_y >> level;
+	if (opts->fit)
+	{
+		uint32_t w = x < lv->cols ? lv->cols - x : 1;
+		uint32_t h = y < lv->rows ? lv->rows - y : 1;
+		cols = w > UINT16_MAX ? UINT16_MAX : w;
+		rows = h > UINT16_MAX ? UINT16_MAX : h;
+	}
+
+	size_t budget = state->nui.mem_budget ? state->nui.mem_budget : NURU_MEM_BUDGET;
+	if ((size_t) cols * rows > budget / sizeof(nuru_cell_s))
+	{
+		return NURU_ERR_TOO_BIG;
+	}
+
+	err = nuru_tiled_get_region(tiled, level, x, y, cols, rows, &state->nui);
+
+	st->load_ns   = t1 - t0;
+	st->decode_ns = nuru_time_ns() - t1;
+	return err < 0 ? err : 0;
+}
+
+/*
+ * Load an image through the daemon's image cache: if the file hasn't changed 
+ * since it was last loaded, the decoded image is used as is, otherwise it's 
+ * loaded into the least recently used slot. Together, the cached images stay 
+ * within the memory budget. Points `nui` to the image.
+ */
+static int
+load_cached(state_s *state, const char *file, nuru_stats_s *st, nuru_img_s **nui)
+{
+	img_cache_s *cache = &state->imgs;
+	struct stat sb;
+	char *path = realpath(file, NULL);
+	if (path == NULL || stat(path, &sb) == -1)
+	{
+		free(path);
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	// the slot with the same file or, failing that, the least recently used
+	size_t slot = 0;
+	for (size_t i = 0; i < IMG_CACHE_SIZE; ++i)
+	{
+		if (cache->paths[i] && strcmp(cache->paths[i], path) == 0)
+		{
+			slot = i;
+			break;
+		}
+		if (cache->used[i] < cache->used[slot])
+		{
+			slot = i;
+		}
+	}
+	cache->used[slot] = ++cache->clock;
+	*nui = &cache->imgs[slot];
+
+	struct stat *old = &cache->sts[slot];
+	if (cache->paths[slot] && strcmp(cache->paths[slot], path) == 0 && same_file(old, &sb))
+	{
+		free(path);
+		return 0;
+	}
+
+	free(cache->paths[slot]);
+	cache->paths[slot] = NULL;
+	cache->imgs[slot].mem_budget = state->nui.mem_budget;
+	int err = nuru_img_load_stats(&cache->imgs[slot], path, st);
+	if (err < 0)
+	{
+		free(path);
+		return err;
+	}
+	cache->paths[slot] = path;
+	cache->sts[slot] = sb;
+
+	// make room by dropping the least recently used of the other images
+	size_t budget = state->nui.mem_budget ? state->nui.mem_budget : NURU_MEM_BUDGET;
+	for (;;)
+	{
+		size_t total = 0;
+		size_t lru = slot;
+		for (size_t i = 0; i < IMG_CACHE_SIZE; ++i)
+		{
+			if (cache->paths[i] == NULL)
+			{
+				continue;
+			}
+			total += cache->imgs[i].num_cells * sizeof(nuru_cell_s);
+			if (i != slot && (lru == slot || cache->used[i] < cache->used[lru]))
+			{
+				lru = i;
+			}
+		}
+		if (total <= budget || lru == slot)
+		{
+			break;
+		}
+		nuru_img_free(&cache->imgs[lru]);
+		free(cache->paths[lru]);
+		cache->paths[lru] = NULL;
+		cache->used[lru] = 0;
+	}
+	return err;
+}
+
+/*
+ * Scale the image down to fit the terminal, if requested and necessary. 
+ * Returns either the scaled image or `nui` itself, NULL on error.
+ */
+static nuru_img_s*
+fit_image(state_s *state, nuru_img_s *nui, nuru_pal_s *nuc, uint8_t pixels)
+{
+	uint16_t cols = state->ws.ws_col;
+	uint16_t rows = state->ws.ws_row * (pixels ? 2 : 1);
+	if (!state->opts->fit || (nui->cols <= cols && nui->rows <= rows))
+	{
+		return nui;
+	}
+
+	double f = (double) cols / nui->cols;
+	if ((double) rows / nui->rows < f)
+	{
+		f = (double) rows / nui->rows;
+	}
+	uint16_t fit_cols = nui->cols * f;
+	uint16_t fit_rows = nui->rows * f;
+
+	if (nuru_img_scale(&state->fit, nui, fit_cols ? fit_cols : 1, 
+				fit_rows ? fit_rows : 1, nuc) < 0)
+	{
+		return NULL;
+	}
+	return &state->fit;
+}
+
+/*
+ * Print the given area of the terminal, either in pixel mode or not.
+ */
+static void
+print_area(state_s *state, nuru_img_s *nui, nuru_pal_s *nug, nuru_pal_s *nuc, uint8_t pixels, area_s *area)
+{
+	if (pixels)
+	{
+		print_nui_px(&state->out, nui, nuc, &state->caps, state->opts, area);
+	}
+	else
+	{
+		print_nui(&state->out, nui, nug, nuc, &state->caps, state->opts, area);
+	}
+}
+
+static void
+on_resize(int sig)
+{
+	(void) sig;
+	resized = 1;
+}
+
+/*
+ * Keep the image, which has just been printed at the top left of the screen, 
+ * around until a key is pressed. When the terminal gets resized, only the 
+ * columns and rows that have been exposed are printed, instead of clearing 
+ * the screen and printing everything again. Scaled images (-s) change as a 
+ * whole with the terminal size, though, so they are printed anew. Besides 
+ * SIGWINCH, the size is checked every HOLD_POLL_MS, as the daemon doesn't get 
+ * the signal for its clients' terminals. Neither does it get their SIGINT, 
+ * so should its client hang up, it stops as if by SIGHUP. `src` is the image 
+ * before scaling.
+ */
+static void
+hold(state_s *state, const char *file, nuru_img_s *src, nuru_img_s *nui, nuru_pal_s *nug, nuru_pal_s *nuc, uint8_t pixels)
+{
+	output_s *out = &state->out;
+	struct termios ta_old, ta_raw;
+	if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &ta_old) != 0)
+	{
+		return;
+	}
+	ta_raw = ta_old;
+	ta_raw.c_lflag &= ~(ICANON | ECHO);
+	ta_raw.c_cc[VMIN] = 1;
+	ta_raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &ta_raw);
+
+	// no SA_RESTART, so that a resize interrupts the wait right away
+	struct sigaction sa = { .sa_handler = on_resize };
+	struct sigaction sa_old;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, &sa_old);
+
+	// keep the cursor at the top, lest shrinking the terminal scrolls the image
+	out_esc(out, ANSI_CURSOR_RESET);
+	out_flush(out);
+
+	// how much of the image is on screen, in terminal cells
+	uint16_t img_rows = pixels ? (nui->rows + 1) / 2 : nui->rows;
+	uint16_t shown_cols = nui->cols < state->ws.ws_col ? nui->cols : state->ws.ws_col;
+	uint16_t shown_rows = img_rows < state->ws.ws_row ? img_rows : state->ws.ws_row;
+
+	uint8_t tiled = file && is_tiled(file);
+	nuru_stats_s st = { 0 };
+	while (!stop_signal)
+	{
+		struct pollfd pfds[2] = {
+			{ .fd = STDIN_FILENO, .events = POLLIN },
+			{ .fd = out->peer, .events = POLLIN }
+		};
+		if (poll(pfds, 2, HOLD_POLL_MS) > 0)
+		{
+			stop_signal = pfds[1].revents ? SIGHUP : 0;
+			break;
+		}
+
+		struct winsize ws;
+		if (term_wsize(&ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)
+		{
+			continue;
+		}
+		if (!resized && ws.ws_col == state->ws.ws_col && ws.ws_row == state->ws.ws_row)
+		{
+			continue;
+		}
+		resized = 0;
+		uint8_t grown = ws.ws_col > state->ws.ws_col || ws.ws_row > state->ws.ws_row;
+		state->ws = ws;
+
+		// tiled images only have the part that fit the terminal loaded
+		if (tiled && grown && load_tiled(state, file, &st) == 0)
+		{
+			nui = src = &state->nui;
+		}
+
+		term_sync_begin(out);
+		if (state->opts->fit)
+		{
+			if ((nui = fit_image(state, src, nuc, pixels)) == NULL)
+			{
+				term_sync_end(out);
+				break;
+			}
+			term_clear(out);
+			shown_cols = shown_rows = 0;
+		}
+
+		img_rows = pixels ? (nui->rows + 1) / 2 : nui->rows;
+		uint16_t cols = nui->cols < ws.ws_col ? nui->cols : ws.ws_col;
+		uint16_t rows = img_rows < ws.ws_row ? img_rows : ws.ws_row;
+
+		// newly exposed columns to the right, then rows below
+		if (cols > shown_cols)
+		{
+			area_s right = { shown_cols, 0, cols - shown_cols, shown_rows < rows ? shown_rows : rows, 1 };
+			print_area(state, nui, nug, nuc, pixels, &right);
+		}
+		if (rows > shown_rows)
+		{
+			area_s below = { 0, shown_rows, cols, rows - shown_rows, 1 };
+			print_area(state, nui, nug, nuc, pixels, &below);
+		}
+		shown_cols = cols;
+		shown_rows = rows;
+
+		out_esc(out, ANSI_CURSOR_RESET);
+		term_sync_end(out);
+		out_flush(out);
+	}
+
+	// put the cursor below the image, for whatever comes next
+	out_esc(out, ANSI_CURSOR_MOVE, shown_rows + 1, 1);
+	out_flush(out);
+	if (!stop_signal)
+	{
+		tcflush(STDIN_FILENO, TCIFLUSH);
+	}
+	tcsetattr(STDIN_FILENO, TCSANOW, &ta_old);
+	sigaction(SIGWINCH, &sa_old, NULL);
+}
+
+/*
+ * Print the given, loaded image, then hold it or print stats, as requested.
+ * `file` is where it came from, NULL if it was composed from layers.
+ */
+static int
+show_image(state_s *state, const char *file, nuru_img_s *nui, nuru_stats_s *st)
+{
+	options_s *opts = state->opts;
+
+	// figure out if the image needs palette files
+	uint8_t using_glyph_pal = (nui->glyph_mode & 128) && nui->glyph_pal[0];
+	uint8_t using_color_pal = (nui->color_mode & 128) && nui->color_pal[0];
+
+	// potentially get a glyph palette
+	nuru_pal_s *nug = &state->nug;
+	if (!opts->nug_file && using_glyph_pal)
+	{
+		if ((nug = get_pal_by_name(&state->pals, "glyphs", nui->glyph_pal)) == NULL)
+		{
+			fprintf(stderr, "Error loading palette: %s\n", nui->glyph_pal);
+			return -1;
+		}
+	}
+
+	// potentially get a color palette
+	nuru_pal_s *nuc = &state->nuc;
+	if (!opts->nuc_file && using_color_pal)
+	{
+		if ((nuc = get_pal_by_name(&state->pals, "colors", nui->color_pal)) == NULL)
+		{
+			fprintf(stderr, "Error loading palette: %s\n", nui->color_pal);
+			return -1;
+		}
+	}
+
+	// in pixel mode, every terminal row holds two rows of the image
+	uint8_t pixels = opts->pixels && nui->glyph_mode == NURU_GLYPH_MODE_NONE;
+	uint64_t t0 = nuru_time_ns();
+
+	// if requested, scale the image down to fit the terminal
+	nuru_img_s *src = nui;
+	if ((nui = fit_image(state, src, nuc, pixels)) == NULL)
+	{
+		fprintf(stderr, "Error scaling image: %s\n", file ? file : "(layers)");
+		return -1;
+	}
+
+	// display nuru image; when holding it, at the top left of a clear screen
+	output_s *out = &state->out;
+	out->stats = opts->stats ? st : NULL;
+
+	area_s area = { 0, 0, state->ws.ws_col, state->ws.ws_row, opts->hold };
+	term_sync_begin(out);
+	if (opts->hold)
+	{
+		term_clear(out);
+	}
+	print_area(state, nui, nug, nuc, pixels, &area);
+	term_sync_end(out);
+	out_flush(out);
+	st->render_ns = nuru_time_ns() - t0;
+	out->stats = NULL;
+
+	if (opts->hold)
+	{
+		hold(state, file, src, nui, nug, nuc, pixels);
+	}
+
+	if (opts->stats)
+	{
+		if (state->batch && file)
+		{
+			fprintf(stderr, "file:       %s\n", file);
+		}
+		stats(st, stderr);
+	}
+	return 0;
+}
+
+/*
+ * Load, then print either the info or the image itself, for one image file.
+ */
+static int
+process_file(state_s *state, const char *file)
 {
-	// make a copy of the name and lower-case it
-	char pal_name[NURU_STR_LEN];
-	strcpy(pal_name, name);
-	make_lower(pal_name);
+	options_s *opts = state->opts;
+	nuru_img_s *nui = &state->nui;
+	nuru_stats_s st = { 0 };
 
-	// get the full path to the palette
-	char path[PATH_MAX];
-	pal_path(path, PATH_MAX, pal_name, type);
+	// validation reads the payload, but doesn't decode it; for tiled images, 
+	// it checks that the offset tables and all tiles are where they belong
+	if (opts->validate)
+	{
+		nuru_tiled_s tiled;
+		int err = is_tiled(file) ? nuru_tiled_open(&tiled, file, 1) : nuru_img_validate(nui, file);
+		if (is_tiled(file) && err == 0)
+		{
+			nuru_tiled_close(&tiled);
+		}
+		fprintf(stdout, "%s: %s\n", file, err_str(err));
+		return err ? -1 : 0;
+	}
 
-	// load the palette
-	return nuru_pal_load(nup, path) == 0 ? 0 : -1;
+	// image information only needs the header, no need to decode the cells
+	if (opts->info)
+	{
+		nuru_tiled_s tiled;
+		int err = is_tiled(file) ? nuru_tiled_open(&tiled, file, 1) : nuru_img_load_header(nui, file);
+		if (err < 0)
+		{
+			fprintf(stderr, "Error loading image file: %s (%s)\n", file, err_str(err));
+			return -1;
+		}
+		if (state->batch)
+		{
+			fprintf(stdout, "file:       %s\n", file);
+		}
+		if (is_tiled(file))
+		{
+			info_tiled(&tiled);
+			nuru_tiled_close(&tiled);
+		}
+		else
+		{
+			info(nui);
+		}
+		return 0;
+	}
+
+	// load nuru image file, or the visible part of a tiled one
+	int err = 0;
+	if (is_tiled(file))
+	{
+		err = load_tiled(state, file, &st);
+	}
+	else if (state->imgs.enabled)
+	{
+		err = load_cached(state, file, &st, &nui);
+	}
+	else if (state->fetched && state->fetched->data)
+	{
+		err = nuru_img_load_mem(nui, state->fetched->data, state->fetched->len, &st);
+	}
+	else
+	{
+		err = nuru_img_load_stats(nui, file, &st);
+	}
+	if (err < 0)
+	{
+		fprintf(stderr, "Error loading image file: %s (%s)\n", file, err_str(err));
+		return -1;
+	}
+	return show_image(state, file, nui, &st);
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Process the oldest file in the prefetch queue, waiting for it to be read 
+ * if need be. Returns 1 if the file couldn't be processed, 0 otherwise.
+ */
+static int
+process_fetched(state_s *state)
 {
-	// parse command line options
-	options_s opts = { 0 };
-	parse_args(argc, argv, &opts);
+	fetch_s *f = prefetch_wait(state->pf);
+	state->fetched = f;
+	int failed = process_file(state, f->file) != 0;
+	state->fetched = NULL;
+	prefetch_pop(state->pf);
+	return failed;
+}
 
-	if (opts.help)
+/*
+ * Process the given file or, when prefetching, queue it up to be read in the 
+ * background while the files before it are processed. Once the queue is 
+ * full, the oldest file is processed first to make room. See process_drain() 
+ * for the files still queued at the end. Returns the number of files that 
+ * couldn't be processed.
+ */
+static int
+process_queue(state_s *state, const char *file)
+{
+	if (state->pf == NULL)
 	{
-		help(argv[0], stdout);
-		return EXIT_SUCCESS;
+		return process_file(state, file) != 0;
 	}
 
-	if (opts.version)
+	int failed = 0;
+	if (prefetch_full(state->pf))
 	{
-		version(stdout);
-		return EXIT_SUCCESS;
+		failed += process_fetched(state);
 	}
+	prefetch_push(state->pf, file);
+	return failed;
+}
 
-	if (opts.nui_file == NULL)
+/*
+ * Process all files left in the prefetch queue.
+ */
+static int
+process_drain(state_s *state)
+{
+	int failed = 0;
+	while (state->pf && !prefetch_empty(state->pf) && !stop_signal)
 	{
-		fprintf(stderr, "No image file given\n");
-		return EXIT_FAILURE;
+		failed += process_fetched(state);
 	}
+	return failed;
+}
 
-	// load nuru image file
-	nuru_img_s nui = { 0 };
-	if (nuru_img_load(&nui, opts.nui_file) == -1)
+/*
+ * Process all image files listed in the given file, one per line.
+ * Returns the number of files that couldn't be processed.
+ */
+static int
+process_list(state_s *state, const char *list)
+{
+	FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+	if (fp == NULL)
 	{
-		fprintf(stderr, "Error loading image file: %s\n", opts.nui_file);
-		return EXIT_FAILURE;
+		fprintf(stderr, "Error opening list file: %s\n", list);
+		return 1;
+	}
+
+	int failed = 0;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n = 0;
+
+	while (!stop_signal && (n = getline(&line, &len, fp)) != -1)
+	{
+		if (n > 0 && line[n - 1] == '\n')
+		{
+			line[--n] = '\0';
+		}
+		if (n == 0)
+		{
+			continue;
+		}
+		failed += process_queue(state, line);
+	}
+
+	free(line);
+	if (fp != stdin)
+	{
+		fclose(fp);
+	}
+	return failed;
+}
+
+/*
+ * Split a layer given as FILE[@COL,ROW[,Z]] into its parts. Without a 
+ * position, the layer goes to the top left; `z` is left as is without a Z.
+ */
+static void
+layer_spec(const char *spec, char *file, size_t len, int32_t *col, int32_t *row, int32_t *z)
+{
+	snprintf(file, len, "%s", spec);
+	*col = 0;
+	*row = 0;
+
+	char *at = strrchr(file, '@');
+	if (at && sscanf(at + 1, "%d,%d,%d", col, row, z) >= 2)
+	{
+		*at = '\0';
+	}
+}
+
+/*
+ * Compose all image files given on the command line into one image, each 
+ * one a layer at the given position, later ones covering earlier ones 
+ * unless a z-order says otherwise. The canvas reaches from the top left to 
+ * the bottom right of the lowest, rightmost layer. Returns 1 on error.
+ */
+static int
+process_layers(state_s *state)
+{
+	options_s *opts = state->opts;
+	nuru_img_s *nui = &state->nui;
+	nuru_stats_s st = { 0 };
+	char file[PATH_MAX];
+	int32_t col, row, z;
+
+	// validation doesn't care about layers
+	if (opts->validate)
+	{
+		int failed = 0;
+		for (int i = 0; i < opts->num_files; ++i)
+		{
+			layer_spec(opts->nui_files[i], file, sizeof(file), &col, &row, &z);
+			failed += process_file(state, file) != 0;
+		}
+		return failed != 0;
+	}
+
+	// the headers tell us how large the canvas has to be
+	int64_t cols = 1;
+	int64_t rows = 1;
+	for (int i = 0; i < opts->num_files; ++i)
+	{
+		layer_spec(opts->nui_files[i], file, sizeof(file), &col, &row, &z);
+		if (nuru_img_load_header(nui, file) < 0)
+		{
+			fprintf(stderr, "Error loading image file: %s\n", file);
+			return 1;
+		}
+		cols = (int64_t) col + nui->cols > cols ? (int64_t) col + nui->cols : cols;
+		rows = (int64_t) row + nui->rows > rows ? (int64_t) row + nui->rows : rows;
+	}
+
+	cols = cols > UINT16_MAX ? UINT16_MAX : cols;
+	rows = rows > UINT16_MAX ? UINT16_MAX : rows;
+	size_t budget = nui->mem_budget ? nui->mem_budget : NURU_MEM_BUDGET;
+	if ((size_t) (cols * rows) > budget / sizeof(nuru_cell_s))
+	{
+		fprintf(stderr, "Error creating canvas (%s)\n", err_str(NURU_ERR_TOO_BIG));
+		return 1;
+	}
+
+	nuru_comp_s comp;
+	if (nuru_comp_init(&comp, cols, rows) != 0)
+	{
+		fprintf(stderr, "Error creating canvas\n");
+		return 1;
+	}
+
+	for (int i = 0; i < opts->num_files && !stop_signal; ++i)
+	{
+		nuru_stats_s lst = { 0 };
+		z = i;
+		layer_spec(opts->nui_files[i], file, sizeof(file), &col, &row, &z);
+		int err = nuru_img_load_stats(nui, file, &lst);
+		if (err < 0)
+		{
+			fprintf(stderr, "Error loading image file: %s (%s)\n", file, err_str(err));
+			nuru_comp_free(&comp);
+			return 1;
+		}
+		st.load_ns += lst.load_ns;
+		st.decode_ns += lst.decode_ns;
+
+		if ((err = nuru_comp_add(&comp, nui, col, row, z)) < 0)
+		{
+			fprintf(stderr, "Error adding layer: %s (%s)\n", file, 
+					err == NURU_ERR_FILE_MODE ? "modes, keys or palettes differ" : err_str(err));
+			nuru_comp_free(&comp);
+			return 1;
+		}
+	}
+
+	uint64_t t0 = nuru_time_ns();
+	nuru_comp_compose(&comp);
+	st.decode_ns += nuru_time_ns() - t0;
+
+	int failed = 0;
+	if (opts->info)
+	{
+		info(&comp.img);
+	}
+	else if (!stop_signal)
+	{
+		failed = show_image(state, NULL, &comp.img, &st) != 0;
 	}
+	nuru_comp_free(&comp);
+	return failed;
+}
+
+/*
+ * Do what the options say: print help, version or image info, validate 
+ * images, or render them to the terminal. Returns the exit status.
+ */
+static int
+run(state_s *state, const char *invocation)
+{
+	options_s *opts = state->opts;
 
-	if (opts.info)
+	if (opts->help)
 	{
-		info(&nui);
+		help(invocation, stdout);
 		return EXIT_SUCCESS;
 	}
 
-	// figure out if the image needs palette files
-	uint8_t using_glyph_pal = (nui.glyph_mode & 128) && nui.glyph_pal[0];
-	uint8_t using_color_pal = (nui.color_mode & 128) && nui.color_pal[0];
+	if (opts->version)
+	{
+		version(stdout);
+		return EXIT_SUCCESS;
+	}
 
-	// potentially load a glyph palette
-	nuru_pal_s nug = { 0 };
-	if (opts.nug_file)
+	if (opts->num_files == 0 && opts->list_file == NULL)
 	{
-		if (nuru_pal_load(&nug, opts.nug_file) == -1)
+		fprintf(stderr, "No image file given\n");
+		return EXIT_FAILURE;
+	}
+
+	state->out.fd = STDOUT_FILENO;
+	state->out.pen = (pen_s) { 0 };
+	state->batch = !opts->layers && (opts->num_files > 1 || opts->list_file);
+	state->nui.mem_budget = opts->mem_budget << 20;
+
+	// potentially load the glyph palette given on the command line
+	if (opts->nug_file)
+	{
+		if (nuru_pal_load(&state->nug, opts->nug_file) != 0)
 		{
-			fprintf(stderr, "Error loading palette file: %s\n", opts.nug_file);
+			fprintf(stderr, "Error loading palette file: %s\n", opts->nug_file);
 			return EXIT_FAILURE;
 		}
 	}
-	else if (using_glyph_pal)
+
+	// potentially load the color palette given on the command line
+	if (opts->nuc_file)
 	{
-		if (load_pal_by_name(&nug, "glyphs", nui.glyph_pal) == -1)
+		if (nuru_pal_load(&state->nuc, opts->nuc_file) != 0)
 		{
-			fprintf(stderr, "Error loading palette: %s\n", nui.glyph_pal);
+			fprintf(stderr, "Error loading palette file: %s\n", opts->nuc_file);
 			return EXIT_FAILURE;
 		}
 	}
 
-	// potentially load a color palette
-	nuru_pal_s nuc = { 0 };
-	if (opts.nuc_file)
+	// only rendering needs the terminal
+	uint8_t render = !opts->info && !opts->validate;
+	if (render)
 	{
-		if (nuru_pal_load(&nuc, opts.nuc_file) == -1)
+		// get the terminal dimensions
+		if (term_wsize(&state->ws) == -1)
+		{
+			fprintf(stderr, "Failed to determine terminal size\n");
+			return EXIT_FAILURE;
+		}
+
+		if (state->ws.ws_col == 0 || state->ws.ws_row == 0)
 		{
-			fprintf(stderr, "Error loading palette file: %s\n", opts.nuc_file);
+			fprintf(stderr, "Terminal size not appropriate\n");
 			return EXIT_FAILURE;
 		}
+
+		// find out what colors the terminal supports
+		term_caps_cached(state);
+
+		// glyphs will be encoded according to the locale, usually UTF-8
+		setlocale(LC_CTYPE, "");
+
+		term_setup(&state->out, opts, &state->caps);
+	}
+
+	// when rendering several images, read the next ones in the background 
+	// while the current one is being decoded and displayed
+	static prefetch_s pf;
+	int prefetch = opts->prefetch == -1 ? PREFETCH_DEFAULT : opts->prefetch;
+	if (render && state->batch && !state->imgs.enabled && prefetch > 0)
+	{
+		size_t max_len = state->nui.mem_budget ? state->nui.mem_budget : NURU_MEM_BUDGET;
+		state->pf = prefetch_init(&pf, prefetch, max_len) == 0 ? &pf : NULL;
+	}
+
+	// display nuru images, one after the other, or all at once as layers
+	int failed = 0;
+	if (opts->layers)
+	{
+		failed += opts->num_files ? process_layers(state) : 0;
+	}
+	for (int i = 0; i < opts->num_files && !opts->layers && !stop_signal; ++i)
+	{
+		failed += process_queue(state, opts->nui_files[i]);
+	}
+	if (opts->list_file && !opts->layers && !stop_signal)
+	{
+		failed += process_list(state, opts->list_file);
+	}
+	failed += process_drain(state);
+
+	if (state->pf)
+	{
+		prefetch_free(state->pf);
+		state->pf = NULL;
+	}
+
+	if (render)
+	{
+		term_reset(&state->out);
+	}
+	if (stop_signal)
+	{
+		return 128 + stop_signal;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Handle one request of a client connected to the daemon: receive the 
+ * client's stdin, stdout and stderr and put them in place of our own, 
+ * take over its working directory and terminal type, then run as if 
+ * invoked with the client's arguments. Returns the exit status.
+ */
+static int
+daemon_request(state_s *state, int conn, int *saved)
+{
+	static char msg[NURU_DAEMON_MAX_MSG + 1];
+	int fds[NURU_DAEMON_NUM_FDS];
+
+	long len = nuru_daemon_recv(conn, msg, NURU_DAEMON_MAX_MSG, fds);
+	if (len < 0)
+	{
+		return EXIT_FAILURE;
+	}
+	msg[len] = '\0';
+
+	// working directory, TERM, COLORTERM, then the arguments
+	char *args[NURU_DAEMON_MAX_ARGS + 1];
+	int num = 0;
+	for (char *p = msg; p < msg + len && num < NURU_DAEMON_MAX_ARGS; p += strlen(p) + 1)
+	{
+		args[num++] = p;
+	}
+	args[num] = NULL;
+
+	int redirected = 1;
+	for (int i = 0; i < NURU_DAEMON_NUM_FDS; ++i)
+	{
+		redirected &= fds[i] != -1 && dup2(fds[i], i) != -1;
+		if (fds[i] != -1)
+		{
+			close(fds[i]);
+		}
 	}
-	else if (using_color_pal)
+
+	int status = EXIT_FAILURE;
+	if (redirected && num >= 3)
 	{
-		if (load_pal_by_name(&nuc, "colors", nui.color_pal) == -1)
+		if (chdir(args[0]) == -1)
 		{
-			fprintf(stderr, "Error loading palette: %s\n", nui.color_pal);
-			return EXIT_FAILURE;
+			fprintf(stderr, "Failed to change to directory: %s\n", args[0]);
+		}
+		else
+		{
+			setenv("TERM", args[1], 1);
+			setenv("COLORTERM", args[2], 1);
+
+			options_s opts = { 0 };
+			args[2] = PROGRAM_NAME;
+			stop_signal = 0;
+			parse_args(num - 2, &args[2], &opts);
+			state->opts = &opts;
+			state->out.peer = conn;
+			status = run(state, PROGRAM_NAME);
+			state->out.peer = -1;
+			state->opts = NULL;
 		}
 	}
-	
-	// get the terminal dimensions
-	struct winsize ws = { 0 };
-	if (term_wsize(&ws) == -1)
+
+	// back to our own stdin, stdout and stderr
+	fflush(stdout);
+	fflush(stderr);
+	for (int i = 0; i < NURU_DAEMON_NUM_FDS; ++i)
+	{
+		dup2(saved[i], i);
+	}
+	return status;
+}
+
+/*
+ * Serve render requests from clients on a Unix socket, one after the other, 
+ * keeping palettes, terminal capabilities and decoded images around.
+ */
+static int
+daemon_serve(state_s *state)
+{
+	char path[PATH_MAX];
+	nuru_daemon_path(path, sizeof(path));
+	if (nuru_daemon_tmpdir(path) == -1)
+	{
+		fprintf(stderr, "Socket directory missing or not ours alone: %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_un addr;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1 || nuru_daemon_addr(&addr, path) == -1)
 	{
-		fprintf(stderr, "Failed to determine terminal size\n");
+		fprintf(stderr, "Failed to create socket: %s\n", path);
 		return EXIT_FAILURE;
 	}
 
-	if (ws.ws_col == 0 || ws.ws_row == 0)
+	// don't pull the socket out from under a daemon that's still running
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0)
 	{
-		fprintf(stderr, "Terminal size not appropriate\n");
+		fprintf(stderr, "Daemon already running: %s\n", path);
 		return EXIT_FAILURE;
 	}
+	close(sock);
+	unlink(path);
 
-	// ensure unicode / wide-character support
-	setlocale(LC_CTYPE, "");
-	if (fwide(stdout, 1) != 1)
+	// only we get to connect
+	mode_t mask = umask(0077);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int err = sock == -1 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+		listen(sock, 16) == -1;
+	umask(mask);
+	if (err)
 	{
-		fprintf(stderr, "Couldn't put terminal in wide-character mode\n");
+		fprintf(stderr, "Failed to listen on socket: %s\n", path);
 		return EXIT_FAILURE;
 	}
 
-	// display nuru image
-	term_setup(&opts);
-	print_nui(&nui, &nug, &nuc, ws.ws_col, ws.ws_row);
+	int saved[NURU_DAEMON_NUM_FDS];
+	for (int i = 0; i < NURU_DAEMON_NUM_FDS; ++i)
+	{
+		saved[i] = fcntl(i, F_DUPFD_CLOEXEC, NURU_DAEMON_NUM_FDS);
+	}
+
+	// clients going away mid-request must not take us down with them
+	signal(SIGPIPE, SIG_IGN);
+
+	// one client that stops reading its output mustn't hold up all others
+	state->imgs.enabled = 1;
+	state->tty = "/dev/stdin";
+	state->out.wait = OUT_WAIT_DAEMON;
+	for (;;)
+	{
+		int conn = accept(sock, NULL, NULL);
+		if (conn == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			break;
+		}
+
+		// other users could have us render our files to their terminals
+		if (nuru_daemon_peer(conn) != 0)
+		{
+			close(conn);
+			continue;
+		}
+
+		// a client that doesn't send its request in time is dropped
+		struct timeval tv = { .tv_sec = 1 };
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		uint8_t status = daemon_request(state, conn, saved);
+		send(conn, &status, 1, MSG_NOSIGNAL);
+		close(conn);
+	}
+
+	fprintf(stderr, "Failed to accept connection: %s\n", path);
+	close(sock);
+	unlink(path);
+	return EXIT_FAILURE;
+}
+
+int
+main(int argc, char **argv)
+{
+	// parse command line options
+	options_s opts = { 0 };
+	parse_args(argc, argv, &opts);
+
+	// this is big, because of the output buffer, hence static
+	static state_s state = { 0 };
+	state.opts = &opts;
+	state.tty = "/dev/tty";
+	state.out.peer = -1;
+
+	int status = opts.daemon ? daemon_serve(&state) : run(&state, argv[0]);
 
 	// clean up and cya 
-	nuru_img_free(&nui);
-	term_reset();
-	return EXIT_SUCCESS;
+	nuru_img_free(&state.nui);
+	nuru_img_free(&state.fit);
+	close_tiled(&state);
+	return status;
 }
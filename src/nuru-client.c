@@ -0,0 +1,138 @@
+#define _GNU_SOURCE       // struct ucred, SO_PEERCRED
+#define NURU_IMPLEMENTATION
+#define NURU_SCOPE static inline
+
+#include <stdio.h>        // fprintf()
+#include <stdlib.h>       // EXIT_SUCCESS, EXIT_FAILURE, getenv()
+#include <stdint.h>       // uint8_t, uint32_t
+#include <string.h>       // strlen(), memcpy()
+#include <unistd.h>       // getcwd(), read(), close()
+#include <limits.h>       // PATH_MAX
+#include <signal.h>       // sigaction(), SIGINT, SIGTERM, SIGHUP
+#include "nuru-daemon.h"  // protocol of nuru-cat --daemon
+
+/*
+ * Thin client for `nuru-cat --daemon`: passes its arguments, working
+ * directory, terminal type and standard streams on to the daemon, which
+ * does all the work, then exits with the daemon's exit status. Takes the
+ * same arguments as nuru-cat itself; NURU_SOCKET overrides the socket path.
+ */
+
+static volatile sig_atomic_t stop_signal;
+
+static void
+on_signal(int sig)
+{
+	stop_signal = sig;
+}
+
+/*
+ * Append a NUL terminated string to the request, if there's room.
+ */
+static int
+add_str(char *msg, uint32_t *len, const char *str)
+{
+	size_t n = strlen(str) + 1;
+	if (*len + n > NURU_DAEMON_MAX_MSG)
+	{
+		return -1;
+	}
+	memcpy(msg + *len, str, n);
+	*len += n;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	static char msg[NURU_DAEMON_MAX_MSG];
+	uint32_t len = 0;
+
+	char cwd[PATH_MAX];
+	char *term = getenv("TERM");
+	char *colorterm = getenv("COLORTERM");
+
+	int err = getcwd(cwd, sizeof(cwd)) == NULL;
+	err += add_str(msg, &len, err ? "/" : cwd) != 0;
+	err += add_str(msg, &len, term ? term : "") != 0;
+	err += add_str(msg, &len, colorterm ? colorterm : "") != 0;
+	err += argc - 1 > NURU_DAEMON_MAX_ARGS - 3;
+	for (int i = 1; i < argc && !err; ++i)
+	{
+		err += add_str(msg, &len, argv[i]) != 0;
+	}
+	if (err)
+	{
+		fprintf(stderr, "Failed to build request\n");
+		return EXIT_FAILURE;
+	}
+
+	char path[PATH_MAX];
+	struct sockaddr_un addr;
+	nuru_daemon_path(path, sizeof(path));
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1 || nuru_daemon_addr(&addr, path) == -1 ||
+			connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+	{
+		fprintf(stderr, "Failed to connect to nuru-cat daemon: %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	// we're about to hand over our terminal, so make sure it's our daemon
+	if (nuru_daemon_peer(sock) != 0)
+	{
+		fprintf(stderr, "Daemon is run by another user: %s\n", path);
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	// no SA_RESTART, so that signals interrupt waiting for the reply
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	int fds[NURU_DAEMON_NUM_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	if (nuru_daemon_send(sock, msg, len, fds) != 0)
+	{
+		fprintf(stderr, "Failed to send request: %s\n", path);
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	// the daemon is using our terminal now, wait until it's done; if we get 
+	// stopped, hanging up has the daemon stop as well and reset the terminal, 
+	// which we wait for, unless stopped once more
+	int stopped = 0;
+	uint8_t status = EXIT_FAILURE;
+	ssize_t n;
+	for (;;)
+	{
+		if (stop_signal && !stopped)
+		{
+			stopped = stop_signal;
+			stop_signal = 0;
+			shutdown(sock, SHUT_WR);
+		}
+		n = read(sock, &status, 1);
+		if (n == -1 && errno == EINTR && !(stopped && stop_signal))
+		{
+			continue;
+		}
+		break;
+	}
+	close(sock);
+
+	if (stopped)
+	{
+		return 128 + stopped;
+	}
+	if (n != 1)
+	{
+		fprintf(stderr, "No reply from nuru-cat daemon: %s\n", path);
+		return EXIT_FAILURE;
+	}
+	return status;
+}
@@ -0,0 +1,250 @@
+#ifndef NURU_DAEMON_H
+#define NURU_DAEMON_H
+
+/*
+ * Protocol between `nuru-cat --daemon` and its clients, over a Unix stream
+ * socket. The client sends one request and waits for the reply:
+ *
+ *   request       uint32 payload length (big endian), then the payload: NUL
+ *                 terminated strings, namely the client's working directory,
+ *                 its TERM and COLORTERM, followed by the nuru-cat arguments.
+ *                 The client's stdin, stdout and stderr are attached to the
+ *                 first byte via SCM_RIGHTS; the daemon renders to those.
+ *   reply         one byte, the exit status of the request
+ *
+ * The daemon handles one request after another, so it can keep palettes,
+ * terminal capabilities and decoded images around in between. Both sides
+ * only talk to a peer run by the same user (SO_PEERCRED, which needs
+ * _GNU_SOURCE to be defined before any system header is included).
+ */
+
+#include <stdio.h>      // snprintf()
+#include <stdlib.h>     // getenv()
+#include <string.h>     // memcpy(), memset()
+#include <unistd.h>     // read(), getuid()
+#include <errno.h>      // errno, EINTR, EEXIST
+#include <sys/socket.h> // sendmsg(), recvmsg(), struct msghdr, SCM_RIGHTS
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/stat.h>   // mkdir(), lstat(), struct stat
+#include "nuru.h"       // NURU_SCOPE
+
+#define NURU_DAEMON_SOCKET   "nuru-cat.sock" // socket file name
+#define NURU_DAEMON_TMPDIR   "/tmp/nuru-%u"  // per-user fallback directory
+#define NURU_DAEMON_NUM_FDS  3      // stdin, stdout, stderr
+#define NURU_DAEMON_MAX_MSG  65536  // max request payload, in bytes
+#define NURU_DAEMON_MAX_ARGS 1024   // max number of arguments per request
+
+NURU_SCOPE int nuru_daemon_path(char *buf, size_t len);
+NURU_SCOPE int nuru_daemon_tmpdir(const char *path);
+NURU_SCOPE int nuru_daemon_peer(int sock);
+NURU_SCOPE int nuru_daemon_addr(struct sockaddr_un *addr, const char *path);
+NURU_SCOPE int nuru_daemon_send(int sock, const char *msg, uint32_t len, int *fds);
+NURU_SCOPE long nuru_daemon_recv(int sock, char *msg, size_t cap, int *fds);
+
+//
+// IMPLEMENTATION
+//
+
+#ifdef NURU_IMPLEMENTATION
+
+/*
+ * Put the path of the daemon's socket into `buf`: NURU_SOCKET if set, else 
+ * a file in XDG_RUNTIME_DIR or, failing that, in a per-user directory in 
+ * /tmp (see nuru_daemon_tmpdir()).
+ */
+NURU_SCOPE int
+nuru_daemon_path(char *buf, size_t len)
+{
+	char *env = getenv("NURU_SOCKET");
+	if (env && env[0])
+	{
+		return snprintf(buf, len, "%s", env);
+	}
+
+	char *run = getenv("XDG_RUNTIME_DIR");
+	if (run && run[0])
+	{
+		return snprintf(buf, len, "%s/%s", run, NURU_DAEMON_SOCKET);
+	}
+	char dir[64];
+	snprintf(dir, sizeof(dir), NURU_DAEMON_TMPDIR, (unsigned) getuid());
+	return snprintf(buf, len, "%s/%s", dir, NURU_DAEMON_SOCKET);
+}
+
+/*
+ * If `path` is in the per-user directory in /tmp, create that directory if 
+ * need be and make sure it is ours alone: a real directory, owned by us, 
+ * without any permissions for others. Returns 0 if it is, or if `path` is 
+ * somewhere else entirely, -1 otherwise.
+ */
+NURU_SCOPE int
+nuru_daemon_tmpdir(const char *path)
+{
+	char dir[64];
+	int n = snprintf(dir, sizeof(dir), NURU_DAEMON_TMPDIR, (unsigned) getuid());
+	if (strncmp(path, dir, n) != 0 || path[n] != '/')
+	{
+		return 0;
+	}
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+	{
+		return -1;
+	}
+
+	struct stat st;
+	if (lstat(dir, &st) == -1)
+	{
+		return -1;
+	}
+	return S_ISDIR(st.st_mode) && st.st_uid == getuid() && !(st.st_mode & 0077) ? 0 : -1;
+}
+
+/*
+ * Check that whoever is on the other end of the connected socket `sock` is 
+ * running as the same user as we are. Returns 0 if so, -1 otherwise.
+ */
+NURU_SCOPE int
+nuru_daemon_peer(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+	{
+		return -1;
+	}
+	return cred.uid == getuid() ? 0 : -1;
+}
+
+/*
+ * Fill in a socket address for the given path. Returns -1 if it's too long.
+ */
+NURU_SCOPE int
+nuru_daemon_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/*
+ * Send a request with the given payload, passing NURU_DAEMON_NUM_FDS file
+ * descriptors along. Returns 0 on success, -1 on error.
+ */
+NURU_SCOPE int
+nuru_daemon_send(int sock, const char *msg, uint32_t len, int *fds)
+{
+	uint8_t head[4] = { len >> 24, len >> 16, len >> 8, len };
+	struct iovec iov = { .iov_base = head, .iov_len = sizeof(head) };
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * NURU_DAEMON_NUM_FDS)];
+	} ctrl;
+	memset(&ctrl, 0, sizeof(ctrl));
+
+	struct msghdr mh = { 0 };
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctrl.buf;
+	mh.msg_controllen = sizeof(ctrl.buf);
+
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int) * NURU_DAEMON_NUM_FDS);
+	memcpy(CMSG_DATA(cm), fds, sizeof(int) * NURU_DAEMON_NUM_FDS);
+
+	if (sendmsg(sock, &mh, MSG_NOSIGNAL) != sizeof(head))
+	{
+		return -1;
+	}
+
+	for (uint32_t done = 0; done < len; )
+	{
+		ssize_t n = send(sock, msg + done, len - done, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Receive a request into `msg`, which can hold `cap` bytes, and the file
+ * descriptors that came with it into `fds`; those not received are set to
+ * -1. Returns the payload length, or -1 on error, in which case all fds
+ * that were received have been closed again.
+ */
+NURU_SCOPE long
+nuru_daemon_recv(int sock, char *msg, size_t cap, int *fds)
+{
+	for (int i = 0; i < NURU_DAEMON_NUM_FDS; ++i)
+	{
+		fds[i] = -1;
+	}
+
+	uint8_t head[4] = { 0 };
+	struct iovec iov = { .iov_base = head, .iov_len = sizeof(head) };
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * NURU_DAEMON_NUM_FDS)];
+	} ctrl;
+	memset(&ctrl, 0, sizeof(ctrl));
+
+	struct msghdr mh = { 0 };
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctrl.buf;
+	mh.msg_controllen = sizeof(ctrl.buf);
+
+	// on error, the control data is left as it was, so there's nothing to take
+	ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	for (struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&mh) : NULL; cm; cm = CMSG_NXTHDR(&mh, cm))
+	{
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+		{
+			size_t num = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), sizeof(int) *
+					(num < NURU_DAEMON_NUM_FDS ? num : NURU_DAEMON_NUM_FDS));
+		}
+	}
+
+	uint32_t len = ((uint32_t) head[0] << 24) | (head[1] << 16) | (head[2] << 8) | head[3];
+	int ok = n == sizeof(head) && !(mh.msg_flags & MSG_CTRUNC) && len <= cap;
+	for (uint32_t done = 0; ok && done < len; )
+	{
+		ssize_t r = read(sock, msg + done, len - done);
+		if (r == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		ok = r > 0;
+		done += ok ? r : 0;
+	}
+
+	for (int i = 0; i < NURU_DAEMON_NUM_FDS && !ok; ++i)
+	{
+		if (fds[i] != -1)
+		{
+			close(fds[i]);
+			fds[i] = -1;
+		}
+	}
+	return ok ? (long) len : -1;
+}
+
+#endif /* NURU_IMPLEMENTATION */
+#endif /* NURU_DAEMON_H */
@@ -0,0 +1,995 @@
+#define NURU_IMPLEMENTATION
+#define NURU_SCOPE static inline
+
+#include <stdio.h>      // fprintf(), fopen(), fread(), ...
+#include <stdlib.h>     // EXIT_SUCCESS, EXIT_FAILURE, malloc()
+#include <stdint.h>     // uint8_t, uint16_t, ...
+#include <string.h>     // strcmp(), strrchr()
+#include <ctype.h>      // isspace(), isdigit()
+#include <unistd.h>     // getopt()
+#include <limits.h>     // UINT16_MAX
+#include "nuru.h"       // nuru minimal reference implementation
+#include "nuru-tile.h"  // tiled nuru images
+
+// program information
+
+#define PROJECT_NAME "nuru"
+#define PROGRAM_NAME "nuru-encode"
+#define PROGRAM_URL  "https://github.com/domsson/nuru-cat"
+
+#define PROGRAM_VER_MAJOR 0
+#define PROGRAM_VER_MINOR 1
+#define PROGRAM_VER_PATCH 0
+
+#define PNM_TOKEN_LEN 32
+
+#define DITHER_NONE       0
+#define DITHER_ORDERED    1     // 4x4 Bayer matrix
+#define DITHER_FS         2     // Floyd-Steinberg error diffusion
+#define DITHER_UNKNOWN    255   // unrecognized -d argument
+#define DITHER_SPREAD     32    // strength of the ordered dither
+
+#define GLYPH_GRID        8     // glyph masks are sampled on an 8x8 grid
+#define GLYPH_SAMPLES     (GLYPH_GRID * GLYPH_GRID)
+#define GLYPH_VECS        (GLYPH_SAMPLES / 8)
+#define CELL_W_DEFAULT    4     // pixels per cell, horizontally
+#define CELL_H_DEFAULT    8     // pixels per cell, vertically
+
+// 8 floats, processed in parallel; the compiler maps this to SSE/AVX/NEON
+typedef float v8f __attribute__((vector_size(32)));
+
+typedef struct options
+{
+	char *in_file;         // PPM/PAM file to read, "-" for stdin
+	char *out_file;        // nuru image file to write
+	char *nuc_file;        // nuru color palette file to quantize to
+	char *nuc_name;        // color palette name to store in the image
+	char *nug_file;        // nuru glyph palette file to pick glyphs from
+	uint16_t cell_w;       // pixels per cell, horizontally (glyph mode)
+	uint16_t cell_h;       // pixels per cell, vertically (glyph mode)
+	uint16_t tile_w;       // write a tiled image with tiles this wide ...
+	uint16_t tile_h;       // ... and this high, in cells
+	uint8_t ansi_4bit;     // use 4-bit instead of 8-bit ANSI colors
+	uint8_t dither;        // dithering method, DITHER_*
+	uint8_t help : 1;      // show help and exit
+	uint8_t version : 1;   // show version and exit
+}
+options_s;
+
+typedef struct pnm
+{
+	FILE *fp;              // file to read the pixels from
+	uint32_t width;        // width in pixels
+	uint32_t height;       // height in pixels
+	uint8_t depth;         // channels: gray, gray + alpha, RGB or RGB + alpha
+	uint16_t maxval;       // maximum value of a channel
+}
+pnm_s;
+
+typedef struct glyph_set
+{
+	v8f masks[NURU_PAL_SIZE][GLYPH_VECS]; // 1 where the glyph is set, else 0
+	float cover[NURU_PAL_SIZE];           // number of samples set per glyph
+	uint8_t idx[NURU_PAL_SIZE];           // palette index of each glyph
+	int num;                              // number of usable glyphs
+	int space;                            // palette index of space, or -1
+}
+glyph_set_s;
+
+typedef struct encoder
+{
+	nuru_img_s *img;       // image being encoded, or one band of tiles
+	nuru_tiled_s *tiled;   // tiled image being written, NULL if not tiling
+	uint32_t cols;         // width of the image, in cells
+	uint32_t rows;         // height of the image, in cells
+	nuru_quant_s quant;    // maps RGB values to the available colors
+	nuru_quant_s quant_fg; // same, but avoiding the foreground key color
+	glyph_set_s glyphs;    // glyphs to choose from (glyph mode)
+	uint16_t cell_w;       // pixels per cell, horizontally (glyph mode)
+	uint16_t cell_h;       // pixels per cell, vertically (glyph mode)
+	uint8_t dither;        // dithering method, DITHER_*
+	int16_t *err_cur;      // Floyd-Steinberg error for the current row
+	int16_t *err_nxt;      // Floyd-Steinberg error for the next row
+}
+encoder_s;
+
+static const int8_t bayer[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 }
+};
+
+/*
+ * Parse command line args into the provided options_s struct.
+ */
+static void
+parse_args(int argc, char **argv, options_s *opts)
+{
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "4c:d:g:hn:s:t:V")) != -1)
+	{
+		switch (o)
+		{
+			case '4':
+				opts->ansi_4bit = 1;
+				break;
+			case 'c':
+				opts->nuc_file = optarg;
+				break;
+			case 'd':
+				opts->dither = 
+					strcmp(optarg, "ordered") == 0 ? DITHER_ORDERED :
+					strcmp(optarg, "fs")      == 0 ? DITHER_FS : DITHER_UNKNOWN;
+				break;
+			case 'g':
+				opts->nug_file = optarg;
+				break;
+			case 'h':
+				opts->help = 1;
+				break;
+			case 'n':
+				opts->nuc_name = optarg;
+				break;
+			case 's':
+				sscanf(optarg, "%hux%hu", &opts->cell_w, &opts->cell_h);
+				break;
+			case 't':
+				sscanf(optarg, "%hux%hu", &opts->tile_w, &opts->tile_h);
+				break;
+			case 'V':
+				opts->version = 1;
+				break;
+		}
+	}
+	if (optind + 1 < argc)
+	{
+		opts->in_file  = argv[optind];
+		opts->out_file = argv[optind + 1];
+	}
+}
+
+/*
+ * Print usage information.
+ */
+static void
+help(const char *invocation, FILE *where)
+{
+	fprintf(where, "USAGE\n");
+	fprintf(where, "\t%s [OPTIONS...] input_file output_file\n\n", invocation);
+	fprintf(where, "Converts a PPM or PAM image (use '-' for stdin) to a nuru image,\n");
+	fprintf(where, "one pixel per cell, quantized to 8-bit ANSI colors by default.\n");
+	fprintf(where, "With a glyph palette, every cell gets the glyph and colors that\n");
+	fprintf(where, "best approximate a block of pixels instead.\n\n");
+	fprintf(where, "OPTIONS\n");
+	fprintf(where, "\t-4\tuse 4-bit instead of 8-bit ANSI colors\n");
+	fprintf(where, "\t-c FILE\tpath to color palette file to quantize to\n");
+	fprintf(where, "\t-d MODE\tdither, MODE being 'ordered' or 'fs' (Floyd-Steinberg)\n");
+	fprintf(where, "\t-g FILE\tpath to glyph palette file to pick glyphs from\n");
+	fprintf(where, "\t-h\tprint this help text and exit\n");
+	fprintf(where, "\t-n NAME\tcolor palette name to store (default: palette file name)\n");
+	fprintf(where, "\t-s WxH\tpixels per cell with -g (default: %dx%d)\n",
+			CELL_W_DEFAULT, CELL_H_DEFAULT);
+	fprintf(where, "\t-t WxH\twrite a tiled image, with tiles of WxH cells\n");
+	fprintf(where, "\t-V\tprint version information and exit\n");
+}
+
+/*
+ * Print version information.
+ */
+static void
+version(FILE *where)
+{
+	fprintf(where, "%s %d.%d.%d\n%s\n", PROGRAM_NAME,
+			PROGRAM_VER_MAJOR, PROGRAM_VER_MINOR, PROGRAM_VER_PATCH,
+			PROGRAM_URL);
+}
+
+/*
+ * Read the next whitespace-delimited token from a PNM header, skipping
+ * comments. Returns the length of the token, 0 on EOF.
+ */
+static size_t
+pnm_token(FILE *fp, char *buf, size_t len)
+{
+	int ch;
+	size_t n = 0;
+
+	// skip whitespace and comments
+	while ((ch = fgetc(fp)) != EOF)
+	{
+		if (ch == '#')
+		{
+			while ((ch = fgetc(fp)) != EOF && ch != '\n');
+			continue;
+		}
+		if (!isspace(ch))
+		{
+			break;
+		}
+	}
+
+	// read the token; the single whitespace after it is consumed as well
+	while (ch != EOF && !isspace(ch))
+	{
+		if (n < len - 1)
+		{
+			buf[n++] = ch;
+		}
+		ch = fgetc(fp);
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ * Read the header of a binary PPM (P6) or PAM (P7) image.
+ */
+static int
+pnm_open(pnm_s *pnm, FILE *fp)
+{
+	char tok[PNM_TOKEN_LEN];
+	pnm->fp = fp;
+
+	if (pnm_token(fp, tok, sizeof(tok)) == 0)
+	{
+		return -1;
+	}
+
+	if (strcmp(tok, "P6") == 0)
+	{
+		pnm->depth = 3;
+		pnm_token(fp, tok, sizeof(tok));
+		pnm->width = atol(tok);
+		pnm_token(fp, tok, sizeof(tok));
+		pnm->height = atol(tok);
+		pnm_token(fp, tok, sizeof(tok));
+		pnm->maxval = atol(tok);
+	}
+	else if (strcmp(tok, "P7") == 0)
+	{
+		while (pnm_token(fp, tok, sizeof(tok)) && strcmp(tok, "ENDHDR") != 0)
+		{
+			if (strcmp(tok, "WIDTH") == 0)
+			{
+				pnm_token(fp, tok, sizeof(tok));
+				pnm->width = atol(tok);
+			}
+			else if (strcmp(tok, "HEIGHT") == 0)
+			{
+				pnm_token(fp, tok, sizeof(tok));
+				pnm->height = atol(tok);
+			}
+			else if (strcmp(tok, "DEPTH") == 0)
+			{
+				pnm_token(fp, tok, sizeof(tok));
+				pnm->depth = atol(tok);
+			}
+			else if (strcmp(tok, "MAXVAL") == 0)
+			{
+				pnm_token(fp, tok, sizeof(tok));
+				pnm->maxval = atol(tok);
+			}
+			// TUPLTYPE is implied by DEPTH, the rest we don't care about
+		}
+	}
+	else
+	{
+		return -1;
+	}
+
+	if (pnm->width == 0 || pnm->height == 0 || pnm->maxval == 0)
+	{
+		return -1;
+	}
+	if (pnm->depth < 1 || pnm->depth > 4)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read one row of pixels, converting it to 8 bit RGB plus alpha.
+ */
+static int
+pnm_read_row(pnm_s *pnm, uint8_t *raw, nuru_rgb_s *rgb, uint8_t *alpha)
+{
+	size_t sample_size = pnm->maxval > 255 ? 2 : 1;
+	size_t row_size = pnm->width * pnm->depth * sample_size;
+
+	if (fread(raw, 1, row_size, pnm->fp) != row_size)
+	{
+		return -1;
+	}
+
+	uint8_t s[4];
+	for (uint32_t x = 0; x < pnm->width; ++x)
+	{
+		uint8_t *px = raw + (x * pnm->depth * sample_size);
+		for (uint8_t c = 0; c < pnm->depth; ++c)
+		{
+			uint32_t v = sample_size == 2 ? (px[c * 2] << 8) | px[c * 2 + 1] : px[c];
+			s[c] = (v * 255) / pnm->maxval;
+		}
+
+		if (pnm->depth <= 2)
+		{
+			rgb[x] = (nuru_rgb_s) { s[0], s[0], s[0] };
+			alpha[x] = pnm->depth == 2 ? s[1] : 255;
+		}
+		else
+		{
+			rgb[x] = (nuru_rgb_s) { s[0], s[1], s[2] };
+			alpha[x] = pnm->depth == 4 ? s[3] : 255;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the index of the available color closest to the given one. The key 
+ * color is never used, as that would make the pixel transparent.
+ */
+static uint8_t
+quantize(encoder_s *enc, nuru_quant_s *q, nuru_rgb_s *rgb)
+{
+	// closed form for the 8-bit ANSI colors, which never returns 0 (key)
+	if (enc->img->color_mode == NURU_COLOR_MODE_8BIT)
+	{
+		return nuru_rgb_to_ansi_8bit(rgb);
+	}
+	return nuru_quant_idx(q, rgb);
+}
+
+static uint8_t
+clamp(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/*
+ * Quantize one row of pixels into the given cells, dithering as requested.
+ */
+static void
+encode_row(encoder_s *enc, nuru_rgb_s *rgb, uint8_t *alpha, nuru_cell_s *row, uint32_t y)
+{
+	nuru_img_s *img = enc->img;
+	nuru_rgb_s *rgbs = enc->quant.rgbs;
+
+	// error buffers have one extra entry on either side, 3 channels each
+	int16_t *cur = enc->err_cur + 3;
+	int16_t *nxt = enc->err_nxt + 3;
+	if (enc->dither == DITHER_FS)
+	{
+		memset(enc->err_nxt, 0, sizeof(int16_t) * (enc->cols + 2) * 3);
+	}
+
+	for (uint32_t x = 0; x < enc->cols; ++x)
+	{
+		row[x].ch = NURU_SPACE;
+		row[x].md = 0;
+
+		if (alpha[x] < 128)
+		{
+			row[x].bg = img->bg_key;
+			row[x].fg = img->bg_key;
+			continue;
+		}
+
+		nuru_rgb_s px = rgb[x];
+		if (enc->dither == DITHER_ORDERED)
+		{
+			int d = ((bayer[y % 4][x % 4] * 2 - 15) * DITHER_SPREAD) / 32;
+			px = (nuru_rgb_s) { clamp(px.r + d), clamp(px.g + d), clamp(px.b + d) };
+		}
+		else if (enc->dither == DITHER_FS)
+		{
+			int16_t *e = &cur[x * 3];
+			px = (nuru_rgb_s) { clamp(px.r + e[0]), clamp(px.g + e[1]), clamp(px.b + e[2]) };
+		}
+
+		uint8_t idx = quantize(enc, &enc->quant, &px);
+		row[x].bg = idx;
+		row[x].fg = idx;
+
+		if (enc->dither == DITHER_FS)
+		{
+			// spread the error: 7/16 right, 3/16 down left, 5/16 down, 1/16 down right
+			int err[3] = { px.r - rgbs[idx].r, px.g - rgbs[idx].g, px.b - rgbs[idx].b };
+			int i = x * 3;
+			for (int c = 0; c < 3; ++c)
+			{
+				cur[i + 3 + c] += (err[c] * 7) / 16;
+				nxt[i - 3 + c] += (err[c] * 3) / 16;
+				nxt[i     + c] += (err[c] * 5) / 16;
+				nxt[i + 3 + c] += (err[c] * 1) / 16;
+			}
+		}
+	}
+
+	// the next row's error becomes the current one
+	int16_t *tmp = enc->err_cur;
+	enc->err_cur = enc->err_nxt;
+	enc->err_nxt = tmp;
+}
+
+/*
+ * Get the cells to encode the given row of the image into. When tiling, the 
+ * image only holds one band of tile_h rows, which gets written out as soon 
+ * as it is complete, see put_row().
+ */
+static nuru_cell_s *
+get_row(encoder_s *enc, uint32_t y)
+{
+	uint32_t band_y = enc->tiled ? y % enc->tiled->tile_h : y;
+	return &enc->img->cells[(size_t) band_y * enc->cols];
+}
+
+/*
+ * Done encoding the given row; when tiling, this writes out the band of 
+ * tiles once its last row is done.
+ */
+static int
+put_row(encoder_s *enc, uint32_t y)
+{
+	if (enc->tiled && (y % enc->tiled->tile_h == enc->tiled->tile_h - 1u || y == enc->rows - 1))
+	{
+		return nuru_tiled_write_band(enc->tiled, 0, enc->img->cells, enc->cols);
+	}
+	return 0;
+}
+
+/*
+ * Read all pixels from the PNM and turn them into cells, one per pixel,
+ * where the pixel's color is the cell's background color.
+ */
+static int
+encode(encoder_s *enc, pnm_s *pnm)
+{
+	size_t sample_size = pnm->maxval > 255 ? 2 : 1;
+
+	uint8_t *raw = malloc(pnm->width * pnm->depth * sample_size);
+	nuru_rgb_s *rgb = malloc(pnm->width * sizeof(nuru_rgb_s));
+	uint8_t *alpha = malloc(pnm->width);
+	enc->err_cur = calloc((pnm->width + 2) * 3, sizeof(int16_t));
+	enc->err_nxt = calloc((pnm->width + 2) * 3, sizeof(int16_t));
+
+	int err = 0;
+	if (!raw || !rgb || !alpha || !enc->err_cur || !enc->err_nxt)
+	{
+		err = -1;
+	}
+
+	for (uint32_t y = 0; y < pnm->height && !err; ++y)
+	{
+		if (pnm_read_row(pnm, raw, rgb, alpha) != 0)
+		{
+			err = -1;
+			break;
+		}
+		encode_row(enc, rgb, alpha, get_row(enc, y), y);
+		err = put_row(enc, y);
+	}
+
+	free(raw);
+	free(rgb);
+	free(alpha);
+	free(enc->err_cur);
+	free(enc->err_nxt);
+	return err;
+}
+
+/*
+ * Coverage of the sample at (x, y) of the glyph grid by the given code point, 
+ * 1 if the glyph is set there, 0 if not. Returns -1 for glyphs we don't know 
+ * the shape of; those are the ones not made up of whole grid samples, which 
+ * includes the shades (U+2591..U+2593): with a mask that is the same across 
+ * the cell, foreground and background can't be told apart by their shape.
+ */
+static int
+glyph_coverage(uint16_t cp, int x, int y)
+{
+	const int n = GLYPH_GRID;
+	const int h = GLYPH_GRID / 2;
+
+	if (cp == NURU_SPACE)                 return 0;
+	if (cp == 0x2580)                     return y < h;                  // upper half
+	if (cp >= 0x2581 && cp <= 0x2587)     return y >= n - (cp - 0x2580); // lower eighths
+	if (cp == 0x2588)                     return 1;                      // full block
+	if (cp >= 0x2589 && cp <= 0x258F)     return x < n - (cp - 0x2588);  // left eighths
+	if (cp == 0x2590)                     return x >= h;                 // right half
+	if (cp == 0x2594)                     return y < 1;                  // upper eighth
+	if (cp == 0x2595)                     return x >= n - 1;             // right eighth
+	if (cp >= 0x2596 && cp <= 0x259F)
+	{
+		// quadrants, bits being upper left, upper right, lower left, lower right
+		static const uint8_t quads[] = { 4, 8, 1, 13, 9, 7, 11, 2, 6, 14 };
+		int quad = (y < h ? 0 : 2) + (x < h ? 0 : 1);
+		return (quads[cp - 0x2596] >> quad) & 1;
+	}
+	return -1;
+}
+
+/*
+ * Build the coverage masks for all glyphs of the palette we know the shape 
+ * of. The key glyph is left out (unless it is a space, which looks the same 
+ * either way), as are duplicates. Returns the number of usable glyphs.
+ */
+static int
+glyph_set_init(glyph_set_s *set, nuru_pal_s *nug)
+{
+	set->num = 0;
+	set->space = -1;
+	for (int i = 0; i < NURU_PAL_SIZE; ++i)
+	{
+		uint16_t cp = nug->data.glyphs[i];
+		if (glyph_coverage(cp, 0, 0) < 0 || (i == nug->ch_key && cp != NURU_SPACE))
+		{
+			continue;
+		}
+
+		int dup = 0;
+		for (int j = 0; j < set->num && !dup; ++j)
+		{
+			dup = nug->data.glyphs[set->idx[j]] == cp;
+		}
+		if (dup)
+		{
+			continue;
+		}
+
+		if (cp == NURU_SPACE)
+		{
+			set->space = i;
+		}
+
+		int g = set->num++;
+		set->idx[g] = i;
+		set->cover[g] = 0;
+		for (int s = 0; s < GLYPH_SAMPLES; ++s)
+		{
+			int m = glyph_coverage(cp, s % GLYPH_GRID, s / GLYPH_GRID);
+			set->masks[g][s / 8][s % 8] = m;
+			set->cover[g] += m;
+		}
+	}
+	return set->num;
+}
+
+/*
+ * Horizontal sum of the 8 floats; taken by pointer, as passing vectors by 
+ * value has a different ABI depending on whether AVX is enabled.
+ */
+static float
+v8f_sum(const v8f *v)
+{
+	return (((*v)[0] + (*v)[1]) + ((*v)[2] + (*v)[3])) + (((*v)[4] + (*v)[5]) + ((*v)[6] + (*v)[7]));
+}
+
+/*
+ * Find the glyph that, drawn with the best fitting fg and bg colors, comes 
+ * closest to the given samples, and return its index into the glyph set.
+ *
+ * For a given mask, the squared error is smallest when fg is the mean of the 
+ * samples where the glyph is set (S1 / n1) and bg the mean of the others 
+ * (S0 / n0), so the colors don't have to be searched for. The error then is 
+ * sum(|p|^2) - |S1|^2 / n1 - |S0|^2 / n0, of which the first term is the same 
+ * for all glyphs; hence, the best glyph maximizes the remaining two terms. 
+ * All it takes per glyph is the masked sum of the samples, computed 8 samples 
+ * at a time.
+ */
+static int
+glyph_match(glyph_set_s *set, v8f *r, v8f *g, v8f *b, nuru_rgb_s *fg, nuru_rgb_s *bg)
+{
+	v8f vr = { 0 }, vg = { 0 }, vb = { 0 };
+	for (int k = 0; k < GLYPH_VECS; ++k)
+	{
+		vr += r[k];
+		vg += g[k];
+		vb += b[k];
+	}
+	float tr = v8f_sum(&vr), tg = v8f_sum(&vg), tb = v8f_sum(&vb);
+
+	int best = 0;
+	float best_score = -1.0f;
+	float best_s1[3] = { 0 };
+	for (int i = 0; i < set->num; ++i)
+	{
+		v8f *m = set->masks[i];
+		v8f sr = { 0 }, sg = { 0 }, sb = { 0 };
+		for (int k = 0; k < GLYPH_VECS; ++k)
+		{
+			sr += m[k] * r[k];
+			sg += m[k] * g[k];
+			sb += m[k] * b[k];
+		}
+
+		float r1 = v8f_sum(&sr), g1 = v8f_sum(&sg), b1 = v8f_sum(&sb);
+		float r0 = tr - r1,     g0 = tg - g1,     b0 = tb - b1;
+		float n1 = set->cover[i];
+		float n0 = GLYPH_SAMPLES - n1;
+
+		float score = 0;
+		score += n1 ? (r1 * r1 + g1 * g1 + b1 * b1) / n1 : 0;
+		score += n0 ? (r0 * r0 + g0 * g0 + b0 * b0) / n0 : 0;
+		if (score > best_score)
+		{
+			best = i;
+			best_score = score;
+			best_s1[0] = r1;
+			best_s1[1] = g1;
+			best_s1[2] = b1;
+		}
+	}
+
+	float n1 = set->cover[best];
+	float n0 = GLYPH_SAMPLES - n1;
+	float t[3] = { tr, tg, tb };
+	float f[3], k[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		// an empty or full glyph only has one color, use it for both
+		k[c] = n0 ? (t[c] - best_s1[c]) / n0 : best_s1[c] / n1;
+		f[c] = n1 ? best_s1[c] / n1 : k[c];
+	}
+	*fg = (nuru_rgb_s) { f[0] + 0.5f, f[1] + 0.5f, f[2] + 0.5f };
+	*bg = (nuru_rgb_s) { k[0] + 0.5f, k[1] + 0.5f, k[2] + 0.5f };
+	return best;
+}
+
+/*
+ * Average the pixels of a band of rows down to the glyph grid, for the cell 
+ * that starts at pixel column x0. The band is `h` rows of `w` pixels each; 
+ * samples beyond the image edge repeat the last pixel column/row.
+ */
+static void
+glyph_sample(encoder_s *enc, nuru_rgb_s *band, uint32_t w, uint32_t h, uint32_t x0,
+		v8f *r, v8f *g, v8f *b)
+{
+	for (int sy = 0; sy < GLYPH_GRID; ++sy)
+	{
+		uint32_t ya = (sy * enc->cell_h) / GLYPH_GRID;
+		uint32_t yb = ((sy + 1) * enc->cell_h) / GLYPH_GRID;
+		yb = yb > ya ? yb : ya + 1;
+		ya = ya < h ? ya : h - 1;
+		yb = yb < h ? yb : h;
+
+		for (int sx = 0; sx < GLYPH_GRID; ++sx)
+		{
+			uint32_t xa = x0 + (sx * enc->cell_w) / GLYPH_GRID;
+			uint32_t xb = x0 + ((sx + 1) * enc->cell_w) / GLYPH_GRID;
+			xb = xb > xa ? xb : xa + 1;
+			xa = xa < w ? xa : w - 1;
+			xb = xb < w ? xb : w;
+
+			uint32_t sum[3] = { 0 };
+			for (uint32_t y = ya; y < yb; ++y)
+			{
+				for (uint32_t x = xa; x < xb; ++x)
+				{
+					nuru_rgb_s *px = &band[(size_t) y * w + x];
+					sum[0] += px->r;
+					sum[1] += px->g;
+					sum[2] += px->b;
+				}
+			}
+
+			float n = (float) ((yb - ya) * (xb - xa));
+			int s = sy * GLYPH_GRID + sx;
+			r[s / 8][s % 8] = sum[0] / n;
+			g[s / 8][s % 8] = sum[1] / n;
+			b[s / 8][s % 8] = sum[2] / n;
+		}
+	}
+}
+
+/*
+ * Read all pixels from the PNM, a band of cell_h rows at a time, and turn 
+ * each block of cell_w by cell_h pixels into the cell that looks most like it.
+ * Blocks with mostly transparent pixels become transparent cells.
+ */
+static int
+encode_glyphs(encoder_s *enc, pnm_s *pnm)
+{
+	nuru_img_s *img = enc->img;
+	size_t sample_size = pnm->maxval > 255 ? 2 : 1;
+	size_t band_size = (size_t) pnm->width * enc->cell_h;
+
+	uint8_t *raw = malloc(pnm->width * pnm->depth * sample_size);
+	nuru_rgb_s *rgb = malloc(band_size * sizeof(nuru_rgb_s));
+	uint8_t *alpha = malloc(band_size);
+
+	int err = 0;
+	if (!raw || !rgb || !alpha)
+	{
+		err = -1;
+	}
+
+	v8f r[GLYPH_VECS], g[GLYPH_VECS], b[GLYPH_VECS];
+	for (uint32_t row = 0; row < enc->rows && !err; ++row)
+	{
+		// read the band of pixel rows for this row of cells
+		uint32_t h = 0;
+		for (uint32_t y = row * enc->cell_h; y < pnm->height && h < enc->cell_h; ++y, ++h)
+		{
+			size_t off = (size_t) h * pnm->width;
+			if (pnm_read_row(pnm, raw, rgb + off, alpha + off) != 0)
+			{
+				err = -1;
+				break;
+			}
+		}
+
+		nuru_cell_s *cells = get_row(enc, row);
+		for (uint32_t col = 0; col < enc->cols && !err; ++col)
+		{
+			uint32_t x0 = col * enc->cell_w;
+			uint32_t x1 = x0 + enc->cell_w < pnm->width ? x0 + enc->cell_w : pnm->width;
+
+			uint32_t opaque = 0;
+			for (uint32_t y = 0; y < h; ++y)
+			{
+				for (uint32_t x = x0; x < x1; ++x)
+				{
+					opaque += alpha[(size_t) y * pnm->width + x] >= 128;
+				}
+			}
+
+			nuru_cell_s *cell = &cells[col];
+			cell->md = 0;
+			if (opaque * 2 < h * (x1 - x0))
+			{
+				cell->ch = img->ch_key;
+				cell->fg = img->fg_key;
+				cell->bg = img->bg_key;
+				continue;
+			}
+
+			nuru_rgb_s fg, bg;
+			glyph_sample(enc, rgb, pnm->width, h, x0, r, g, b);
+			int i = glyph_match(&enc->glyphs, r, g, b, &fg, &bg);
+			cell->ch = enc->glyphs.idx[i];
+			cell->fg = quantize(enc, &enc->quant_fg, &fg);
+			cell->bg = quantize(enc, &enc->quant, &bg);
+
+			// if both colors ended up the same, the glyph doesn't matter
+			if (cell->fg == cell->bg && enc->glyphs.space >= 0)
+			{
+				cell->ch = enc->glyphs.space;
+			}
+		}
+
+		if (!err)
+		{
+			err = put_row(enc, row);
+		}
+	}
+
+	free(raw);
+	free(rgb);
+	free(alpha);
+	return err;
+}
+
+/*
+ * Derive a palette name from a palette file path: the file name, without
+ * directories and extension, cut off to fit into the image header.
+ */
+static void
+pal_name(char *buf, const char *path)
+{
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	size_t len = 0;
+	while (name[len] && name[len] != '.' && len < NURU_STR_LEN_RAW)
+	{
+		buf[len] = name[len];
+		++len;
+	}
+	buf[len] = '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+	// parse command line options
+	options_s opts = { 0 };
+	parse_args(argc, argv, &opts);
+
+	if (opts.help)
+	{
+		help(argv[0], stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.version)
+	{
+		version(stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.in_file == NULL || opts.out_file == NULL)
+	{
+		fprintf(stderr, "Input and output file required\n");
+		return EXIT_FAILURE;
+	}
+
+	if (opts.dither == DITHER_UNKNOWN)
+	{
+		fprintf(stderr, "Unknown dither mode, use 'ordered' or 'fs'\n");
+		return EXIT_FAILURE;
+	}
+
+	// potentially load a color palette
+	nuru_pal_s nuc = { 0 };
+	if (opts.nuc_file)
+	{
+		if (nuru_pal_load(&nuc, opts.nuc_file) != 0)
+		{
+			fprintf(stderr, "Error loading palette file: %s\n", opts.nuc_file);
+			return EXIT_FAILURE;
+		}
+		if (nuc.type != NURU_PAL_TYPE_COLOR_8BIT && nuc.type != NURU_PAL_TYPE_COLOR_RGB)
+		{
+			fprintf(stderr, "Not a color palette: %s\n", opts.nuc_file);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// potentially load a glyph palette, switching to glyph mode
+	nuru_pal_s nug = { 0 };
+	if (opts.nug_file)
+	{
+		if (nuru_pal_load(&nug, opts.nug_file) != 0)
+		{
+			fprintf(stderr, "Error loading palette file: %s\n", opts.nug_file);
+			return EXIT_FAILURE;
+		}
+		if (nug.type != NURU_PAL_TYPE_GLYPH_UNICODE)
+		{
+			fprintf(stderr, "Not a glyph palette: %s\n", opts.nug_file);
+			return EXIT_FAILURE;
+		}
+	}
+
+	uint16_t cell_w = opts.nug_file ? (opts.cell_w ? opts.cell_w : CELL_W_DEFAULT) : 1;
+	uint16_t cell_h = opts.nug_file ? (opts.cell_h ? opts.cell_h : CELL_H_DEFAULT) : 1;
+
+	// open input image
+	FILE *fp = strcmp(opts.in_file, "-") == 0 ? stdin : fopen(opts.in_file, "rb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Error opening input file: %s\n", opts.in_file);
+		return EXIT_FAILURE;
+	}
+
+	pnm_s pnm = { 0 };
+	if (pnm_open(&pnm, fp) != 0)
+	{
+		fprintf(stderr, "Not a supported PPM/PAM file: %s\n", opts.in_file);
+		return EXIT_FAILURE;
+	}
+
+	// tiled images can be larger than what fits into a nuru image
+	uint8_t tiling = opts.tile_w && opts.tile_h;
+	uint32_t cols = (pnm.width  + cell_w - 1) / cell_w;
+	uint32_t rows = (pnm.height + cell_h - 1) / cell_h;
+	if (!tiling && (cols > UINT16_MAX || rows > UINT16_MAX))
+	{
+		fprintf(stderr, "Image too large: %ux%u\n", pnm.width, pnm.height);
+		return EXIT_FAILURE;
+	}
+
+	// set up the nuru image
+	nuru_img_s nui = { 0 };
+	nui.version    = NURU_IMG_VERSION;
+	nui.glyph_mode = NURU_GLYPH_MODE_NONE;
+	nui.mdata_mode = NURU_MDATA_MODE_NONE;
+	nui.cols       = tiling ? 0 : cols;
+	nui.rows       = tiling ? 0 : rows;
+
+	if (opts.nug_file)
+	{
+		nui.glyph_mode = NURU_GLYPH_MODE_PALETTE;
+		nui.ch_key = nug.ch_key;
+		pal_name(nui.glyph_pal, opts.nug_file);
+	}
+
+	if (opts.nuc_file)
+	{
+		nui.color_mode = NURU_COLOR_MODE_PALETTE;
+		nui.fg_key = nuc.fg_key;
+		nui.bg_key = nuc.bg_key;
+		pal_name(nui.color_pal, opts.nuc_name ? opts.nuc_name : opts.nuc_file);
+	}
+	else if (opts.ansi_4bit)
+	{
+		// all 16 colors are needed, unless there is transparency to encode
+		uint8_t alpha = pnm.depth == 2 || pnm.depth == 4;
+		nui.color_mode = NURU_COLOR_MODE_4BIT;
+		nui.fg_key = alpha ? 0 : 16;
+		nui.bg_key = alpha ? 0 : 16;
+	}
+	else
+	{
+		// 8-bit colors 0..15 are never used, so 0 is free to be the key
+		nui.color_mode = NURU_COLOR_MODE_8BIT;
+	}
+
+	// when tiling, only one band of tiles is kept in memory at a time
+	nui.num_cells = (size_t) cols * (tiling ? opts.tile_h : rows);
+	if (nuru_img_reserve(&nui, nui.num_cells) != 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	nuru_tiled_s tiled = { 0 };
+	if (tiling && nuru_tiled_create(&tiled, opts.out_file, &nui, cols, rows,
+				opts.tile_w, opts.tile_h, 1) != 0)
+	{
+		fprintf(stderr, "Error writing image file: %s\n", opts.out_file);
+		nuru_img_free(&nui);
+		return EXIT_FAILURE;
+	}
+
+	// convert pixels to cells; the encoder is big, hence static
+	static encoder_s enc = { 0 };
+	enc.img = &nui;
+	enc.tiled = tiling ? &tiled : NULL;
+	enc.cols = cols;
+	enc.rows = rows;
+	enc.dither = opts.dither;
+	enc.cell_w = cell_w;
+	enc.cell_h = cell_h;
+
+	nuru_rgb_s rgbs[NURU_PAL_SIZE];
+	int num_rgbs = nuru_img_rgbs(&nui, &nuc, rgbs);
+	nuru_quant_init(&enc.quant, rgbs, num_rgbs, nui.bg_key);
+
+	int err = 0;
+	if (opts.nug_file)
+	{
+		if (glyph_set_init(&enc.glyphs, &nug) == 0)
+		{
+			fprintf(stderr, "No usable glyphs in palette: %s\n", opts.nug_file);
+			nuru_img_free(&nui);
+			return EXIT_FAILURE;
+		}
+		nuru_quant_init(&enc.quant_fg, rgbs, num_rgbs, nui.fg_key);
+		err = encode_glyphs(&enc, &pnm);
+	}
+	else
+	{
+		err = encode(&enc, &pnm);
+	}
+	if (fp != stdin)
+	{
+		fclose(fp);
+	}
+	if (err != 0)
+	{
+		fprintf(stderr, "Error encoding input file: %s\n", opts.in_file);
+		if (tiling)
+		{
+			nuru_tiled_finish(&tiled);
+		}
+		nuru_img_free(&nui);
+		return EXIT_FAILURE;
+	}
+
+	// write nuru image, or what's left of the tiled one
+	err = tiling ? nuru_tiled_finish(&tiled) : nuru_img_save(&nui, opts.out_file);
+	if (err != 0)
+	{
+		fprintf(stderr, "Error writing image file: %s\n", opts.out_file);
+		nuru_img_free(&nui);
+		return EXIT_FAILURE;
+	}
+
+	nuru_img_free(&nui);
+	return EXIT_SUCCESS;
+}
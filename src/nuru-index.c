@@ -0,0 +1,447 @@
+#define NURU_IMPLEMENTATION
+#define NURU_SCOPE static inline
+
+#include <stdio.h>      // fprintf(), fopen(), fread(), ...
+#include <stdlib.h>     // EXIT_SUCCESS, EXIT_FAILURE, malloc()
+#include <stdint.h>     // uint8_t, uint16_t, ...
+#include <string.h>     // strcmp(), strlen(), strdup()
+#include <unistd.h>     // getopt(), sysconf()
+#include <dirent.h>     // opendir(), readdir(), DT_DIR, ...
+#include <pthread.h>    // pthread_create(), pthread_mutex_t, ...
+#include <limits.h>     // PATH_MAX
+#include <sys/stat.h>   // stat(), fstat()
+#include "nuru.h"       // nuru minimal reference implementation
+
+// program information
+
+#define PROJECT_NAME "nuru"
+#define PROGRAM_NAME "nuru-index"
+#define PROGRAM_URL  "https://github.com/domsson/nuru-cat"
+
+#define PROGRAM_VER_MAJOR 0
+#define PROGRAM_VER_MINOR 1
+#define PROGRAM_VER_PATCH 0
+
+#define QUEUE_SIZE    1024      // paths waiting for a worker
+#define THREADS_MAX   256       // upper limit for -j
+#define NUI_EXT       ".nui"    // extension of files to index in directories
+
+typedef struct options
+{
+	char **paths;          // files and directories to index
+	int num_paths;         // number of paths
+	int threads;           // number of worker threads, 0 for one per CPU
+	uint8_t checksum : 1;  // read the payload to compute a checksum
+	uint8_t help : 1;      // show help and exit
+	uint8_t version : 1;   // show version and exit
+}
+options_s;
+
+typedef struct queue
+{
+	char *paths[QUEUE_SIZE];  // ring buffer of paths, owned by the queue
+	size_t head;              // next path to take
+	size_t num;               // number of paths in the queue
+	uint8_t done;             // no more paths will be added
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+}
+queue_s;
+
+typedef struct indexer
+{
+	queue_s queue;         // paths for the workers to index
+	uint8_t checksum;      // compute payload checksums
+	int errors;            // number of files that couldn't be indexed
+	pthread_mutex_t lock;  // protects `errors`
+}
+indexer_s;
+
+/*
+ * Parse command line args into the provided options_s struct.
+ */
+static void
+parse_args(int argc, char **argv, options_s *opts)
+{
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "chj:V")) != -1)
+	{
+		switch (o)
+		{
+			case 'c':
+				opts->checksum = 1;
+				break;
+			case 'h':
+				opts->help = 1;
+				break;
+			case 'j':
+				opts->threads = atoi(optarg);
+				break;
+			case 'V':
+				opts->version = 1;
+				break;
+		}
+	}
+	opts->paths = argv + optind;
+	opts->num_paths = argc - optind;
+}
+
+/*
+ * Print usage information.
+ */
+static void
+help(const char *invocation, FILE *where)
+{
+	fprintf(where, "USAGE\n");
+	fprintf(where, "\t%s [OPTIONS...] path...\n\n", invocation);
+	fprintf(where, "Prints one tab-separated line per nuru image: path, cols, rows,\n");
+	fprintf(where, "glyph mode, color mode, mdata mode, glyph palette, color palette,\n");
+	fprintf(where, "payload size and checksum. Directories are searched recursively\n");
+	fprintf(where, "for '%s' files. Only headers are read, unless -c is given.\n", NUI_EXT);
+	fprintf(where, "Images that have a checksum in their header always show it.\n\n");
+	fprintf(where, "OPTIONS\n");
+	fprintf(where, "\t-c\tread the payload and compute (or verify) its checksum\n");
+	fprintf(where, "\t-h\tprint this help text and exit\n");
+	fprintf(where, "\t-j NUM\tnumber of threads (default: one per CPU)\n");
+	fprintf(where, "\t-V\tprint version information and exit\n");
+}
+
+/*
+ * Print version information.
+ */
+static void
+version(FILE *where)
+{
+	fprintf(where, "%s %d.%d.%d\n%s\n", PROGRAM_NAME,
+			PROGRAM_VER_MAJOR, PROGRAM_VER_MINOR, PROGRAM_VER_PATCH,
+			PROGRAM_URL);
+}
+
+static void
+queue_init(queue_s *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+static void
+queue_free(queue_s *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+}
+
+/*
+ * Add a copy of the path to the queue, waiting for room if it is full.
+ */
+static int
+queue_push(queue_s *q, const char *path)
+{
+	char *copy = strdup(path);
+	if (copy == NULL)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	while (q->num == QUEUE_SIZE)
+	{
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	q->paths[(q->head + q->num++) % QUEUE_SIZE] = copy;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/*
+ * Take the next path off the queue, waiting for one if it is empty. Returns
+ * NULL once the queue is empty and done; the caller has to free the path.
+ */
+static char *
+queue_pop(queue_s *q)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->num == 0 && !q->done)
+	{
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+
+	char *path = NULL;
+	if (q->num)
+	{
+		path = q->paths[q->head];
+		q->head = (q->head + 1) % QUEUE_SIZE;
+		q->num--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return path;
+}
+
+/*
+ * Mark the queue as done, waking up all workers waiting for paths.
+ */
+static void
+queue_done(queue_s *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static uint8_t
+has_ext(const char *name, const char *ext)
+{
+	size_t len = strlen(name);
+	size_t ext_len = strlen(ext);
+	return len > ext_len && strcmp(name + len - ext_len, ext) == 0;
+}
+
+/*
+ * Recursively queue all nuru image files in the given directory. Symlinks to
+ * regular files are followed, symlinks to directories are not, so there is no
+ * way to end up in a loop, and dangling symlinks are skipped.
+ */
+static int
+walk_dir(indexer_s *idx, const char *dir)
+{
+	DIR *dp = opendir(dir);
+	if (dp == NULL)
+	{
+		fprintf(stderr, "Error opening directory: %s\n", dir);
+		return -1;
+	}
+
+	int err = 0;
+	char path[PATH_MAX];
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		const char *sep = dir[strlen(dir) - 1] == '/' ? "" : "/";
+		if (snprintf(path, sizeof(path), "%s%s%s", dir, sep, de->d_name) >= (int) sizeof(path))
+		{
+			fprintf(stderr, "Path too long: %s/%s\n", dir, de->d_name);
+			err = -1;
+			continue;
+		}
+
+		// not all file systems fill in d_type, fall back to lstat() then
+		struct stat st;
+		uint8_t type = de->d_type;
+		if (type == DT_UNKNOWN)
+		{
+			type = lstat(path, &st) != 0 ? DT_UNKNOWN :
+				S_ISDIR(st.st_mode) ? DT_DIR :
+				S_ISREG(st.st_mode) ? DT_REG :
+				S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+		}
+
+		// follow symlinks to regular files, but never to directories
+		if (type == DT_LNK)
+		{
+			type = stat(path, &st) == 0 && S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR)
+		{
+			err |= walk_dir(idx, path);
+		}
+		else if (type == DT_REG && has_ext(de->d_name, NUI_EXT))
+		{
+			err |= queue_push(&idx->queue, path);
+		}
+	}
+
+	closedir(dp);
+	return err;
+}
+
+/*
+ * Read the header of one image file, and potentially hash its payload, then
+ * print its index line. Only the header is read, unless a checksum is wanted;
+ * images of version 2+ have the checksum in the header, which then gets 
+ * verified against the payload instead.
+ */
+static int
+index_file(indexer_s *idx, const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	char head_buf[NURU_IMG_HEAD_SIZE + NURU_IMG_SUM_SIZE];
+	if (!idx->checksum)
+	{
+		setvbuf(fp, head_buf, _IOFBF, sizeof(head_buf));
+	}
+
+	nuru_img_s img = { 0 };
+	struct stat st;
+	int err = nuru_img_read_head(&img, fp);
+	if (err == 0 && fstat(fileno(fp), &st) != 0)
+	{
+		err = NURU_ERR_FILE_READ;
+	}
+	if (err != 0)
+	{
+		fclose(fp);
+		return err;
+	}
+
+	char sum[16] = "-";
+	if (img.version >= 2)
+	{
+		snprintf(sum, sizeof(sum), "%08x", img.checksum);
+	}
+
+	if (idx->checksum)
+	{
+		uint8_t buf[NURU_BUF_SIZE];
+		nuru_hash_s h;
+		nuru_hash_init(&h);
+		size_t len;
+		while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		{
+			nuru_hash_update(&h, buf, len);
+		}
+		if (ferror(fp))
+		{
+			fclose(fp);
+			return NURU_ERR_FILE_READ;
+		}
+
+		uint32_t hash = nuru_hash_final(&h);
+		if (img.version >= 2 && hash != img.checksum)
+		{
+			fclose(fp);
+			return NURU_ERR_CHECKSUM;
+		}
+		snprintf(sum, sizeof(sum), "%08x", hash);
+	}
+	fclose(fp);
+
+	long long head = nuru_img_head_size(&img);
+	long long payload = st.st_size > head ? st.st_size - head : 0;
+
+	// one fprintf() per line, so that lines of different threads don't mix
+	fprintf(stdout, "%s\t%u\t%u\t%u\t%u\t%u\t%s\t%s\t%lld\t%s\n", path,
+			img.cols, img.rows, img.glyph_mode, img.color_mode, img.mdata_mode,
+			img.glyph_pal[0] ? img.glyph_pal : "-",
+			img.color_pal[0] ? img.color_pal : "-",
+			payload, sum);
+	return 0;
+}
+
+/*
+ * Worker thread: index files until the queue runs dry.
+ */
+static void *
+worker(void *arg)
+{
+	indexer_s *idx = arg;
+	char *path;
+	while ((path = queue_pop(&idx->queue)) != NULL)
+	{
+		if (index_file(idx, path) != 0)
+		{
+			fprintf(stderr, "Error indexing image file: %s\n", path);
+			pthread_mutex_lock(&idx->lock);
+			idx->errors++;
+			pthread_mutex_unlock(&idx->lock);
+		}
+		free(path);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	// parse command line options
+	options_s opts = { 0 };
+	parse_args(argc, argv, &opts);
+
+	if (opts.help)
+	{
+		help(argv[0], stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.version)
+	{
+		version(stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.num_paths == 0)
+	{
+		fprintf(stderr, "No files or directories given\n");
+		return EXIT_FAILURE;
+	}
+
+	int threads = opts.threads > 0 ? opts.threads : sysconf(_SC_NPROCESSORS_ONLN);
+	threads = threads < 1 ? 1 : threads > THREADS_MAX ? THREADS_MAX : threads;
+
+	static indexer_s idx = { 0 };
+	idx.checksum = opts.checksum;
+	queue_init(&idx.queue);
+	pthread_mutex_init(&idx.lock, NULL);
+
+	// start the workers, then feed them paths as we find them
+	pthread_t tids[THREADS_MAX];
+	int started = 0;
+	for (; started < threads; ++started)
+	{
+		if (pthread_create(&tids[started], NULL, worker, &idx) != 0)
+		{
+			break;
+		}
+	}
+	if (started == 0)
+	{
+		fprintf(stderr, "Error starting threads\n");
+		return EXIT_FAILURE;
+	}
+
+	int err = 0;
+	for (int i = 0; i < opts.num_paths; ++i)
+	{
+		struct stat st;
+		if (stat(opts.paths[i], &st) != 0)
+		{
+			fprintf(stderr, "Error opening file: %s\n", opts.paths[i]);
+			err = -1;
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			err |= walk_dir(&idx, opts.paths[i]);
+		}
+		else
+		{
+			err |= queue_push(&idx.queue, opts.paths[i]);
+		}
+	}
+
+	queue_done(&idx.queue);
+	for (int i = 0; i < started; ++i)
+	{
+		pthread_join(tids[i], NULL);
+	}
+
+	queue_free(&idx.queue);
+	pthread_mutex_destroy(&idx.lock);
+	return err || idx.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,400 @@
+#ifndef NURU_LAYER_H
+#define NURU_LAYER_H
+
+/*
+ * Compositor for stacking nuru images ("layers") on a canvas, each at its
+ * own position and z-order, and turning them into one image that can be
+ * rendered in one go, rather than printing every image on its own.
+ *
+ * Cells that use an image's key values are transparent: a layer's glyph (and
+ * with it, its foreground color and meta data) only covers what's below if
+ * it isn't ch_key, its background color only if it isn't bg_key. All layers
+ * need to have the same modes, keys and palettes, which the composed image
+ * then has as well; canvas cells that no layer covers are all keys.
+ *
+ * Every layer's cells are split into separate planes (glyphs, fg, bg, meta
+ * data) once, when the layer is added, so that composing only needs to run
+ * a branchless masked blend over each layer's part of every canvas row.
+ * Layers can then be moved, hidden or restacked at will before composing.
+ */
+
+#include <stdlib.h>     // malloc(), realloc(), free()
+#include "nuru.h"       // nuru_img_s, nuru_cell_s, ...
+
+typedef struct nuru_layer
+{
+	uint16_t *ch;          // glyphs, cols * rows, row by row
+	uint16_t *md;          // meta data
+	uint8_t  *fg;          // foreground colors
+	uint8_t  *bg;          // background colors
+	uint16_t cols;         // width of the layer, in cells
+	uint16_t rows;         // height of the layer, in cells
+	int32_t  col;          // canvas column of the layer's left edge, can be < 0
+	int32_t  row;          // canvas row of the layer's top edge, can be < 0
+	int32_t  z;            // layers with a higher z cover those with a lower one
+	uint32_t seq;          // order of addition, later layers cover earlier ones
+	uint8_t  hidden;       // leave the layer out when composing
+}
+nuru_layer_s;
+
+typedef struct nuru_comp
+{
+	nuru_img_s img;        // composed image, modes and keys of the first layer
+	nuru_layer_s *layers;  // all layers, in order of addition
+	size_t num_layers;     // number of layers
+	size_t cap_layers;     // number of layers allocated
+	nuru_layer_s **order;  // layers sorted by z, bottom first
+	uint8_t sorted;        // order is up to date
+
+	uint16_t *ch;          // planes of the canvas row being composed
+	uint16_t *md;
+	uint8_t  *fg;
+	uint8_t  *bg;
+}
+nuru_comp_s;
+
+NURU_SCOPE int nuru_comp_init(nuru_comp_s *comp, uint16_t cols, uint16_t rows);
+NURU_SCOPE int nuru_comp_add(nuru_comp_s *comp, nuru_img_s *img, int32_t col, int32_t row, int32_t z);
+NURU_SCOPE int nuru_comp_update(nuru_comp_s *comp, size_t idx, nuru_img_s *img);
+NURU_SCOPE int nuru_comp_set_z(nuru_comp_s *comp, size_t idx, int32_t z);
+NURU_SCOPE int nuru_comp_compose(nuru_comp_s *comp);
+NURU_SCOPE void nuru_comp_free(nuru_comp_s *comp);
+
+//
+// IMPLEMENTATION
+//
+
+#ifdef NURU_IMPLEMENTATION
+
+/*
+ * Get a canvas of the given size ready. The composed image's header is only
+ * filled in once the first layer has been added.
+ */
+NURU_SCOPE int
+nuru_comp_init(nuru_comp_s* comp, uint16_t cols, uint16_t rows)
+{
+	*comp = (nuru_comp_s) { 0 };
+	if (cols == 0 || rows == 0)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	comp->img.cols = cols;
+	comp->img.rows = rows;
+	comp->img.num_cells = (size_t) cols * rows;
+
+	// one block for the row planes, the 16 bit ones first for alignment
+	void* planes = malloc((size_t) cols * 6);
+	if (planes == NULL || nuru_img_reserve(&comp->img, comp->img.num_cells) != 0)
+	{
+		free(planes);
+		nuru_img_free(&comp->img);
+		return NURU_ERR_MEMORY;
+	}
+	comp->ch = planes;
+	comp->md = comp->ch + cols;
+	comp->fg = (uint8_t*) (comp->md + cols);
+	comp->bg = comp->fg + cols;
+	return 0;
+}
+
+/*
+ * Split the image's cells into the layer's planes, (re)allocating them.
+ */
+NURU_SCOPE int
+nuru_comp_split(nuru_layer_s* layer, nuru_img_s* img)
+{
+	size_t n = (size_t) img->cols * img->rows;
+	if (layer->ch == NULL || (size_t) layer->cols * layer->rows < n)
+	{
+		void* planes = realloc(layer->ch, n * 6);
+		if (planes == NULL)
+		{
+			return NURU_ERR_MEMORY;
+		}
+		layer->ch = planes;
+	}
+	layer->md = layer->ch + n;
+	layer->fg = (uint8_t*) (layer->md + n);
+	layer->bg = layer->fg + n;
+	layer->cols = img->cols;
+	layer->rows = img->rows;
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		layer->ch[i] = img->cells[i].ch;
+		layer->md[i] = img->cells[i].md;
+		layer->fg[i] = img->cells[i].fg;
+		layer->bg[i] = img->cells[i].bg;
+	}
+	return 0;
+}
+
+/*
+ * Check that the image can go onto the canvas, taking over its modes, keys
+ * and palettes if it's the first one.
+ */
+NURU_SCOPE int
+nuru_comp_check(nuru_comp_s* comp, nuru_img_s* img)
+{
+	nuru_img_s* dst = &comp->img;
+	if (img->cells == NULL || img->num_cells < (size_t) img->cols * img->rows)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	if (comp->num_layers == 0)
+	{
+		memcpy(dst->signature, img->signature, NURU_STR_LEN);
+		memcpy(dst->glyph_pal, img->glyph_pal, NURU_STR_LEN);
+		memcpy(dst->color_pal, img->color_pal, NURU_STR_LEN);
+		dst->version    = img->version;
+		dst->glyph_mode = img->glyph_mode;
+		dst->color_mode = img->color_mode;
+		dst->mdata_mode = img->mdata_mode;
+		dst->ch_key     = img->ch_key;
+		dst->fg_key     = img->fg_key;
+		dst->bg_key     = img->bg_key;
+		return 0;
+	}
+
+	if (img->glyph_mode != dst->glyph_mode ||
+			img->color_mode != dst->color_mode ||
+			img->mdata_mode != dst->mdata_mode ||
+			img->ch_key != dst->ch_key ||
+			img->fg_key != dst->fg_key ||
+			img->bg_key != dst->bg_key ||
+			strncmp(img->glyph_pal, dst->glyph_pal, NURU_STR_LEN) ||
+			strncmp(img->color_pal, dst->color_pal, NURU_STR_LEN))
+	{
+		return NURU_ERR_FILE_MODE;
+	}
+	return 0;
+}
+
+/*
+ * Add the image as a new layer, with its top left cell at the given canvas
+ * position. The cells are copied, so the image can be reused right away.
+ * Returns the index of the layer (which stays valid), or an error.
+ */
+NURU_SCOPE int
+nuru_comp_add(nuru_comp_s* comp, nuru_img_s* img, int32_t col, int32_t row, int32_t z)
+{
+	int err = nuru_comp_check(comp, img);
+	if (err != 0)
+	{
+		return err;
+	}
+
+	if (comp->num_layers == comp->cap_layers)
+	{
+		size_t cap = comp->cap_layers ? comp->cap_layers * 2 : 8;
+		nuru_layer_s* layers = realloc(comp->layers, cap * sizeof(nuru_layer_s));
+		if (layers == NULL)
+		{
+			return NURU_ERR_MEMORY;
+		}
+		comp->layers = layers;
+
+		nuru_layer_s** order = realloc(comp->order, cap * sizeof(nuru_layer_s*));
+		if (order == NULL)
+		{
+			return NURU_ERR_MEMORY;
+		}
+		comp->order = order;
+		comp->cap_layers = cap;
+	}
+
+	nuru_layer_s* layer = &comp->layers[comp->num_layers];
+	*layer = (nuru_layer_s) { 0 };
+	if (nuru_comp_split(layer, img) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
+	layer->col = col;
+	layer->row = row;
+	layer->z = z;
+	layer->seq = comp->num_layers;
+
+	comp->sorted = 0;
+	return comp->num_layers++;
+}
+
+/*
+ * Replace the cells of a layer with those of the given image, for sprites
+ * that change. The image can have a different size than before.
+ */
+NURU_SCOPE int
+nuru_comp_update(nuru_comp_s* comp, size_t idx, nuru_img_s* img)
+{
+	if (idx >= comp->num_layers)
+	{
+		return NURU_ERR_OTHER;
+	}
+	int err = nuru_comp_check(comp, img);
+	if (err != 0)
+	{
+		return err;
+	}
+	return nuru_comp_split(&comp->layers[idx], img);
+}
+
+/*
+ * Move a layer up or down the stack. Position and visibility, on the other
+ * hand, can be changed in the layer itself.
+ */
+NURU_SCOPE int
+nuru_comp_set_z(nuru_comp_s* comp, size_t idx, int32_t z)
+{
+	if (idx >= comp->num_layers)
+	{
+		return NURU_ERR_OTHER;
+	}
+	comp->layers[idx].z = z;
+	comp->sorted = 0;
+	return 0;
+}
+
+/*
+ * Sort the layers by z, bottom first, those with the same z by the order
+ * they were added in. There are rarely more than a few dozen layers, which
+ * are mostly in order already, so insertion sort it is.
+ */
+NURU_SCOPE void
+nuru_comp_sort(nuru_comp_s* comp)
+{
+	for (size_t i = 0; i < comp->num_layers; ++i)
+	{
+		nuru_layer_s* layer = &comp->layers[i];
+		size_t j = i;
+		for (; j > 0; --j)
+		{
+			nuru_layer_s* prev = comp->order[j - 1];
+			if (prev->z < layer->z || (prev->z == layer->z && prev->seq < layer->seq))
+			{
+				break;
+			}
+			comp->order[j] = prev;
+		}
+		comp->order[j] = layer;
+	}
+	comp->sorted = 1;
+}
+
+/*
+ * Blend `n` cells of a layer's row over the canvas row: every plane takes
+ * the layer's value where its mask is set, keeping its own otherwise. The
+ * glyph mask covers glyph, foreground color and meta data, the background
+ * mask only the background color. No branches, so the compiler can turn
+ * this into SIMD code.
+ */
+NURU_SCOPE void
+nuru_comp_blend(nuru_comp_s* comp, nuru_layer_s* layer, size_t src, size_t dst, size_t n)
+{
+	uint16_t* restrict dch = comp->ch + dst;
+	uint16_t* restrict dmd = comp->md + dst;
+	uint8_t*  restrict dfg = comp->fg + dst;
+	uint8_t*  restrict dbg = comp->bg + dst;
+	const uint16_t* restrict sch = layer->ch + src;
+	const uint16_t* restrict smd = layer->md + src;
+	const uint8_t*  restrict sfg = layer->fg + src;
+	const uint8_t*  restrict sbg = layer->bg + src;
+	uint16_t ch_key = comp->img.ch_key;
+	uint8_t  bg_key = comp->img.bg_key;
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		uint16_t m  = -(uint16_t) (sch[i] != ch_key);
+		uint8_t  m8 = (uint8_t) m;
+		uint8_t  mb = -(uint8_t) (sbg[i] != bg_key);
+		dch[i] = (dch[i] & ~m)  | (sch[i] & m);
+		dmd[i] = (dmd[i] & ~m)  | (smd[i] & m);
+		dfg[i] = (dfg[i] & ~m8) | (sfg[i] & m8);
+		dbg[i] = (dbg[i] & ~mb) | (sbg[i] & mb);
+	}
+}
+
+/*
+ * Compose all visible layers into `comp->img`, one canvas row at a time:
+ * the row starts out transparent, every layer overlapping it gets blended
+ * over it, bottom to top, then the row is written to the image's cells.
+ * That way, the canvas row stays in cache, no matter how many layers. Set 
+ * `comp->img.hash_rows` to have the rows hashed as well, for frame diffing.
+ */
+NURU_SCOPE int
+nuru_comp_compose(nuru_comp_s* comp)
+{
+	nuru_img_s* img = &comp->img;
+	if (!comp->sorted)
+	{
+		nuru_comp_sort(comp);
+	}
+	if (img->hash_rows && nuru_img_reserve_rows(img) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
+
+	for (uint32_t r = 0; r < img->rows; ++r)
+	{
+		for (uint32_t c = 0; c < img->cols; ++c)
+		{
+			comp->ch[c] = img->ch_key;
+			comp->md[c] = 0;
+			comp->fg[c] = img->fg_key;
+			comp->bg[c] = img->bg_key;
+		}
+
+		for (size_t i = 0; i < comp->num_layers; ++i)
+		{
+			nuru_layer_s* layer = comp->order[i];
+			int64_t y = (int64_t) r - layer->row;
+			if (layer->hidden || y < 0 || y >= layer->rows)
+			{
+				continue;
+			}
+
+			// clip the layer's row to the canvas
+			int64_t c0 = layer->col < 0 ? 0 : layer->col;
+			int64_t c1 = (int64_t) layer->col + layer->cols;
+			c1 = c1 > img->cols ? img->cols : c1;
+			if (c0 >= c1)
+			{
+				continue;
+			}
+			size_t src = (size_t) y * layer->cols + (c0 - layer->col);
+			nuru_comp_blend(comp, layer, src, c0, c1 - c0);
+		}
+
+		nuru_cell_s* cells = img->cells + (size_t) r * img->cols;
+		for (uint32_t c = 0; c < img->cols; ++c)
+		{
+			cells[c].ch = comp->ch[c];
+			cells[c].md = comp->md[c];
+			cells[c].fg = comp->fg[c];
+			cells[c].bg = comp->bg[c];
+		}
+		if (img->hash_rows)
+		{
+			img->row_hashes[r] = nuru_img_row_hash(img, r);
+		}
+	}
+	img->hashes_valid = img->hash_rows;
+	return 0;
+}
+
+NURU_SCOPE void
+nuru_comp_free(nuru_comp_s* comp)
+{
+	for (size_t i = 0; i < comp->num_layers; ++i)
+	{
+		free(comp->layers[i].ch);
+	}
+	free(comp->layers);
+	free(comp->order);
+	free(comp->ch);
+	nuru_img_free(&comp->img);
+	*comp = (nuru_comp_s) { 0 };
+}
+
+#endif /* NURU_IMPLEMENTATION */
+#endif /* NURU_LAYER_H */
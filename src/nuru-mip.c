@@ -0,0 +1,333 @@
+#define NURU_IMPLEMENTATION
+#define NURU_SCOPE static inline
+
+#include <stdio.h>      // fprintf(), sscanf(), ...
+#include <stdlib.h>     // EXIT_SUCCESS, EXIT_FAILURE, malloc()
+#include <stdint.h>     // uint8_t, uint16_t, ...
+#include <string.h>     // strcmp(), strrchr(), memcpy()
+#include <unistd.h>     // getopt()
+#include "nuru.h"       // nuru minimal reference implementation
+#include "nuru-tile.h"  // tiled nuru images
+
+// program information
+
+#define PROJECT_NAME "nuru"
+#define PROGRAM_NAME "nuru-mip"
+#define PROGRAM_URL  "https://github.com/domsson/nuru-cat"
+
+#define PROGRAM_VER_MAJOR 0
+#define PROGRAM_VER_MINOR 1
+#define PROGRAM_VER_PATCH 0
+
+#define MIP_MIN_COLS   160      // by default, add levels until one fits ...
+#define MIP_MIN_ROWS   50       // ... into a terminal of this size
+#define TILE_W_DEFAULT 128      // tile size if the input isn't tiled
+#define TILE_H_DEFAULT 64
+
+typedef struct options
+{
+	char *in_file;         // nuru image or tiled image to read
+	char *out_file;        // tiled image to write
+	char *nuc_file;        // color palette, for images that use one
+	uint8_t levels;        // number of levels, 0 for automatic
+	uint16_t tile_w;       // tile width, 0 for the input's or default
+	uint16_t tile_h;       // tile height, 0 for the input's or default
+	uint8_t help : 1;      // show help and exit
+	uint8_t version : 1;   // show version and exit
+}
+options_s;
+
+typedef struct level
+{
+	uint32_t cols;         // width of this level, in cells
+	uint32_t rows;         // height of this level, in cells
+	uint32_t y;            // next row of this level to come in
+	nuru_cell_s *band;     // rows waiting to be written, tile_h of them
+	nuru_cell_s *row;      // row of this level made from the previous one
+	nuru_acc_s *accs;      // the next level's row, being accumulated
+}
+level_s;
+
+typedef struct pyramid
+{
+	nuru_tiled_s *out;     // tiled image being written
+	nuru_img_s *head;      // modes and keys of the image
+	nuru_rgb_s rgbs[NURU_PAL_SIZE];
+	int num_rgbs;          // number of colors in rgbs
+	level_s levels[NURU_TILE_MAX_LEVELS];
+	int num_levels;
+}
+pyramid_s;
+
+/*
+ * Parse command line args into the provided options_s struct.
+ */
+static void
+parse_args(int argc, char **argv, options_s *opts)
+{
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "c:hl:t:V")) != -1)
+	{
+		switch (o)
+		{
+			case 'c':
+				opts->nuc_file = optarg;
+				break;
+			case 'h':
+				opts->help = 1;
+				break;
+			case 'l':
+				opts->levels = atoi(optarg);
+				break;
+			case 't':
+				sscanf(optarg, "%hux%hu", &opts->tile_w, &opts->tile_h);
+				break;
+			case 'V':
+				opts->version = 1;
+				break;
+		}
+	}
+	if (optind + 1 < argc)
+	{
+		opts->in_file  = argv[optind];
+		opts->out_file = argv[optind + 1];
+	}
+}
+
+/*
+ * Print usage information.
+ */
+static void
+help(const char *invocation, FILE *where)
+{
+	fprintf(where, "USAGE\n");
+	fprintf(where, "\t%s [OPTIONS...] input_file output_file\n\n", invocation);
+	fprintf(where, "Writes a nuru image or tiled image as a tiled image with downsampled\n");
+	fprintf(where, "levels, each half the size of the previous one, for nuru-cat -z.\n\n");
+	fprintf(where, "OPTIONS\n");
+	fprintf(where, "\t-c FILE\tcolor palette of the image, if it uses one\n");
+	fprintf(where, "\t-h\tprint this help text and exit\n");
+	fprintf(where, "\t-l NUM\tnumber of levels (default: until one fits %dx%d)\n",
+			MIP_MIN_COLS, MIP_MIN_ROWS);
+	fprintf(where, "\t-t WxH\ttile size (default: input's, or %dx%d)\n",
+			TILE_W_DEFAULT, TILE_H_DEFAULT);
+	fprintf(where, "\t-V\tprint version information and exit\n");
+}
+
+/*
+ * Print version information.
+ */
+static void
+version(FILE *where)
+{
+	fprintf(where, "%s %d.%d.%d\n%s\n", PROGRAM_NAME,
+			PROGRAM_VER_MAJOR, PROGRAM_VER_MINOR, PROGRAM_VER_PATCH,
+			PROGRAM_URL);
+}
+
+/*
+ * Hand the next row of the given level to the pyramid. The row is added to
+ * the level's band, which is written out once complete, and accumulated
+ * into the next level, every two of which make up one row of the next level.
+ * All levels are thereby written in a single pass over the full size image.
+ */
+static int
+feed_row(pyramid_s *p, int l, nuru_cell_s *row)
+{
+	level_s *lv = &p->levels[l];
+	uint16_t tile_h = p->out->tile_h;
+
+	int err = 0;
+	memcpy(&lv->band[(size_t) (lv->y % tile_h) * lv->cols], row, sizeof(nuru_cell_s) * lv->cols);
+	if (lv->y % tile_h == tile_h - 1u || lv->y == lv->rows - 1)
+	{
+		err = nuru_tiled_write_band(p->out, l, lv->band, lv->cols);
+	}
+
+	if (err == 0 && l + 1 < p->num_levels)
+	{
+		for (uint32_t c = 0; c < lv->cols; ++c)
+		{
+			nuru_acc_cell(&lv->accs[c / 2], &row[c], p->head, p->rgbs);
+		}
+
+		if (lv->y % 2 == 1 || lv->y == lv->rows - 1)
+		{
+			level_s *next = &p->levels[l + 1];
+			for (uint32_t c = 0; c < next->cols; ++c)
+			{
+				nuru_acc_get(&lv->accs[c], &next->row[c], p->head, p->rgbs, p->num_rgbs);
+			}
+			err = feed_row(p, l + 1, next->row);
+		}
+	}
+
+	lv->y++;
+	return err;
+}
+
+/*
+ * Allocate the buffers of all levels.
+ */
+static int
+pyramid_init(pyramid_s *p, nuru_tiled_s *out, nuru_img_s *head, nuru_pal_s *nuc)
+{
+	p->out = out;
+	p->head = head;
+	p->num_levels = out->num_levels;
+	p->num_rgbs = nuru_img_rgbs(head, nuc, p->rgbs);
+
+	for (int l = 0; l < p->num_levels; ++l)
+	{
+		level_s *lv = &p->levels[l];
+		lv->cols = out->levels[l].cols;
+		lv->rows = out->levels[l].rows;
+		lv->band = malloc(sizeof(nuru_cell_s) * lv->cols * out->tile_h);
+		lv->row  = malloc(sizeof(nuru_cell_s) * lv->cols);
+		lv->accs = calloc((lv->cols + 1) / 2, sizeof(nuru_acc_s));
+		if (!lv->band || !lv->row || !lv->accs)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+pyramid_free(pyramid_s *p)
+{
+	for (int l = 0; l < p->num_levels; ++l)
+	{
+		free(p->levels[l].band);
+		free(p->levels[l].row);
+		free(p->levels[l].accs);
+	}
+}
+
+/*
+ * Check if the file is a tiled image, going by its extension.
+ */
+static uint8_t
+is_tiled(const char *file)
+{
+	const char *ext = strrchr(file, '.');
+	return ext && strcmp(ext + 1, NURU_TILE_FILEEXT) == 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	// parse command line options
+	options_s opts = { 0 };
+	parse_args(argc, argv, &opts);
+
+	if (opts.help)
+	{
+		help(argv[0], stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.version)
+	{
+		version(stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.in_file == NULL || opts.out_file == NULL)
+	{
+		fprintf(stderr, "Input and output file required\n");
+		return EXIT_FAILURE;
+	}
+
+	// open the input, either a tiled image or a nuru image; the latter is
+	// loaded as a whole, regardless of its size, as this is an offline tool
+	nuru_tiled_s in = { 0 };
+	nuru_img_s nui = { 0 };
+	nui.mem_budget = SIZE_MAX;
+
+	uint8_t tiled = is_tiled(opts.in_file);
+	int err = tiled ? nuru_tiled_open(&in, opts.in_file, 0) : nuru_img_load(&nui, opts.in_file);
+	if (err < 0)
+	{
+		fprintf(stderr, "Error loading image file: %s\n", opts.in_file);
+		return EXIT_FAILURE;
+	}
+
+	nuru_img_s *head = tiled ? &in.head : &nui;
+	uint32_t cols = tiled ? in.levels[0].cols : nui.cols;
+	uint32_t rows = tiled ? in.levels[0].rows : nui.rows;
+	uint16_t tile_w = opts.tile_w ? opts.tile_w : tiled ? in.tile_w : TILE_W_DEFAULT;
+	uint16_t tile_h = opts.tile_h ? opts.tile_h : tiled ? in.tile_h : TILE_H_DEFAULT;
+
+	// averaging colors of a palette image needs the palette's colors
+	nuru_pal_s nuc = { 0 };
+	if (head->color_mode == NURU_COLOR_MODE_PALETTE)
+	{
+		if (opts.nuc_file == NULL || nuru_pal_load(&nuc, opts.nuc_file) != 0)
+		{
+			fprintf(stderr, "Image uses color palette '%s', pass it via -c\n", head->color_pal);
+			return EXIT_FAILURE;
+		}
+	}
+
+	int levels = opts.levels;
+	if (levels == 0)
+	{
+		uint32_t c = cols, r = rows;
+		for (levels = 1; (c > MIP_MIN_COLS || r > MIP_MIN_ROWS) && levels < NURU_TILE_MAX_LEVELS; ++levels)
+		{
+			c = (c + 1) / 2;
+			r = (r + 1) / 2;
+		}
+	}
+	levels = levels > NURU_TILE_MAX_LEVELS ? NURU_TILE_MAX_LEVELS : levels;
+
+	nuru_tiled_s out;
+	if (nuru_tiled_create(&out, opts.out_file, head, cols, rows, tile_w, tile_h, levels) != 0)
+	{
+		fprintf(stderr, "Error writing image file: %s\n", opts.out_file);
+		return EXIT_FAILURE;
+	}
+
+	static pyramid_s pyr = { 0 };
+	if (pyramid_init(&pyr, &out, head, &nuc) != 0)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	// feed the full size image to the pyramid, row by row
+	err = 0;
+	if (tiled)
+	{
+		nuru_cell_s *band = malloc(sizeof(nuru_cell_s) * cols * in.tile_h);
+		err = band ? 0 : NURU_ERR_MEMORY;
+		for (uint32_t ty = 0; ty < in.levels[0].tiles_y && err == 0; ++ty)
+		{
+			err = nuru_tiled_get_band(&in, 0, ty, band, cols);
+			for (uint32_t y = 0; y < in.tile_h && ty * in.tile_h + y < rows && err == 0; ++y)
+			{
+				err = feed_row(&pyr, 0, &band[(size_t) y * cols]);
+			}
+		}
+		free(band);
+		nuru_tiled_close(&in);
+	}
+	else
+	{
+		for (uint32_t y = 0; y < rows && err == 0; ++y)
+		{
+			err = feed_row(&pyr, 0, &nui.cells[(size_t) y * cols]);
+		}
+		nuru_img_free(&nui);
+	}
+
+	pyramid_free(&pyr);
+	if (nuru_tiled_finish(&out) != 0 || err != 0)
+	{
+		fprintf(stderr, "Error writing image file: %s\n", opts.out_file);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,712 @@
+#ifndef NURU_TILE_H
+#define NURU_TILE_H
+
+/*
+ * Tiled nuru images, for canvases too large for a nuru image: 32 bit
+ * dimensions, split into fixed-size tiles that are loaded on demand.
+ *
+ * File layout (all integers big endian):
+ *
+ *   header        NURU_TILE_HEAD_SIZE bytes: signature, version, glyph,
+ *                 color and mdata mode, ch, fg and bg key, glyph and color
+ *                 palette name, tile width and height, number of levels
+ *   levels        cols and rows (uint32 each) per level
+ *   offset tables per level, one uint64 file offset per tile (row-major)
+ *   tiles         cells encoded as in a nuru image payload, row by row;
+ *                 tiles at the right and bottom edge are only as large as
+ *                 the canvas, not the full tile size. Tiles can be in any
+ *                 order, so that all levels can be written in one go
+ *
+ * Level 0 is the full canvas; every further level has half the cols and rows
+ * (rounded up) of the previous one. Tiles are read with pread(), so any
+ * number of readers can share the file, each keeping an LRU cache of
+ * decoded tiles no larger than it asks for.
+ */
+
+#include <stdlib.h>     // malloc(), calloc(), free()
+#include <unistd.h>     // pread(), close()
+#include <fcntl.h>      // open()
+#include <sys/stat.h>   // fstat(), struct stat
+#include "nuru.h"       // nuru_img_s, nuru_cell_s, ...
+
+#define NURU_TILE_SIGNATURE  "NURUTIL"
+#define NURU_TILE_FILEEXT    "nut"
+#define NURU_TILE_VERSION    1
+#define NURU_TILE_HEAD_SIZE  36    // bytes of header in a file
+#define NURU_TILE_LEVEL_SIZE 8     // bytes per level in the level list
+#define NURU_TILE_MAX_LEVELS 16
+#define NURU_TILE_CACHE_SIZE 64    // default number of decoded tiles to keep
+
+typedef struct nuru_tile_level
+{
+	uint32_t cols;         // width of the canvas at this level, in cells
+	uint32_t rows;         // height of the canvas at this level, in cells
+	uint32_t tiles_x;      // number of tiles per row of tiles
+	uint32_t tiles_y;      // number of rows of tiles
+	uint64_t *offsets;     // file offset per tile
+	uint32_t next_y;       // next row of tiles to be written
+}
+nuru_tile_level_s;
+
+typedef struct nuru_tile_slot
+{
+	nuru_cell_s *cells;    // decoded cells, tile_w per row
+	uint64_t used;         // when the tile was last used, for LRU eviction
+	uint64_t tile;         // index of the tile within its level
+	uint8_t  level;        // level of the tile
+	uint8_t  valid;        // slot holds a tile
+}
+nuru_tile_slot_s;
+
+typedef struct nuru_tiled
+{
+	nuru_img_s head;       // modes, keys and palette names (no cells)
+	uint16_t tile_w;       // tile width, in cells
+	uint16_t tile_h;       // tile height, in cells
+	uint8_t  num_levels;   // number of levels, at least 1
+	nuru_tile_level_s levels[NURU_TILE_MAX_LEVELS];
+
+	int fd;                // file to read tiles from
+	nuru_tile_slot_s *slots;
+	size_t num_slots;      // max number of tiles to keep decoded
+	uint64_t clock;        // incremented on every tile access
+	size_t hits;           // tile accesses served from the cache
+	size_t misses;         // tile accesses that had to read the file
+	uint8_t *buf;          // raw data of one tile
+
+	FILE *fp;              // file to write tiles to
+}
+nuru_tiled_s;
+
+NURU_SCOPE int nuru_tiled_open(nuru_tiled_s *t, const char *file, size_t cache_tiles);
+NURU_SCOPE int nuru_tiled_close(nuru_tiled_s *t);
+NURU_SCOPE nuru_cell_s* nuru_tiled_tile(nuru_tiled_s *t, uint8_t level, uint64_t tile);
+NURU_SCOPE int nuru_tiled_get_region(nuru_tiled_s *t, uint8_t level, uint32_t col, uint32_t row,
+		uint16_t cols, uint16_t rows, nuru_img_s *dst);
+NURU_SCOPE int nuru_tiled_get_band(nuru_tiled_s *t, uint8_t level, uint32_t tile_y,
+		nuru_cell_s *cells, size_t stride);
+
+NURU_SCOPE int nuru_tiled_create(nuru_tiled_s *t, const char *file, nuru_img_s *head,
+		uint32_t cols, uint32_t rows, uint16_t tile_w, uint16_t tile_h, uint8_t num_levels);
+NURU_SCOPE int nuru_tiled_write_band(nuru_tiled_s *t, uint8_t level, nuru_cell_s *cells, size_t stride);
+NURU_SCOPE int nuru_tiled_finish(nuru_tiled_s *t);
+
+//
+// IMPLEMENTATION
+//
+
+#ifdef NURU_IMPLEMENTATION
+
+NURU_SCOPE uint32_t
+nuru_tile_get32(const uint8_t* p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+NURU_SCOPE uint64_t
+nuru_tile_get64(const uint8_t* p)
+{
+	return ((uint64_t) nuru_tile_get32(p) << 32) | nuru_tile_get32(p + 4);
+}
+
+NURU_SCOPE size_t
+nuru_tile_put32(uint8_t* p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return 4;
+}
+
+NURU_SCOPE size_t
+nuru_tile_put64(uint8_t* p, uint64_t v)
+{
+	nuru_tile_put32(p, v >> 32);
+	nuru_tile_put32(p + 4, v);
+	return 8;
+}
+
+/*
+ * Fill in the dimensions of all levels, halving them from one to the next.
+ */
+NURU_SCOPE void
+nuru_tile_levels(nuru_tiled_s* t, uint32_t cols, uint32_t rows)
+{
+	for (int l = 0; l < t->num_levels; ++l)
+	{
+		nuru_tile_level_s* lv = &t->levels[l];
+		lv->cols = cols;
+		lv->rows = rows;
+		lv->tiles_x = ((uint64_t) cols + t->tile_w - 1) / t->tile_w;
+		lv->tiles_y = ((uint64_t) rows + t->tile_h - 1) / t->tile_h;
+		cols = cols / 2 + (cols & 1);
+		rows = rows / 2 + (rows & 1);
+	}
+}
+
+/*
+ * Offset of the given level's offset table in the file.
+ */
+NURU_SCOPE uint64_t
+nuru_tile_table_pos(nuru_tiled_s* t, uint8_t level)
+{
+	uint64_t pos = NURU_TILE_HEAD_SIZE + (uint64_t) t->num_levels * NURU_TILE_LEVEL_SIZE;
+	for (int l = 0; l < level; ++l)
+	{
+		pos += (uint64_t) t->levels[l].tiles_x * t->levels[l].tiles_y * 8;
+	}
+	return pos;
+}
+
+/*
+ * Cols and rows of the given tile; edge tiles can be smaller than tile size.
+ */
+NURU_SCOPE void
+nuru_tile_dims(nuru_tiled_s* t, nuru_tile_level_s* lv, uint32_t tx, uint32_t ty,
+		uint32_t* w, uint32_t* h)
+{
+	uint64_t x = (uint64_t) tx * t->tile_w;
+	uint64_t y = (uint64_t) ty * t->tile_h;
+	*w = lv->cols - x < t->tile_w ? lv->cols - x : t->tile_w;
+	*h = lv->rows - y < t->tile_h ? lv->rows - y : t->tile_h;
+}
+
+/*
+ * Open a tiled image for reading, keeping at most `cache_tiles` decoded
+ * tiles in memory (0 for NURU_TILE_CACHE_SIZE). Only the header and the
+ * offset tables are read here; tiles are read when they are needed. Offset 
+ * tables or tiles that would reach past the end of the file are rejected 
+ * (NURU_ERR_FILE_SIZE), before anything is allocated for them, as are tiles 
+ * larger than NURU_MEM_BUDGET (NURU_ERR_TOO_BIG) and level dimensions other 
+ * than those the first level implies (NURU_ERR_FILE_TYPE). Tiles larger than 
+ * the canvas have their size clamped to it, which keeps the layout the same.
+ */
+NURU_SCOPE int
+nuru_tiled_open(nuru_tiled_s* t, const char* file, size_t cache_tiles)
+{
+	*t = (nuru_tiled_s) { 0 };
+	t->fd = open(file, O_RDONLY);
+	if (t->fd == -1)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	struct stat st;
+	uint8_t head[NURU_TILE_HEAD_SIZE];
+	if (fstat(t->fd, &st) == -1 || pread(t->fd, head, sizeof(head), 0) != sizeof(head))
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_FILE_READ;
+	}
+
+	if (memcmp(head, NURU_TILE_SIGNATURE, NURU_STR_LEN_RAW) != 0)
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_FILE_TYPE;
+	}
+	if (head[7] > NURU_TILE_VERSION)
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_IMG_VER;
+	}
+
+	nuru_img_s* img = &t->head;
+	memcpy(img->signature, NURU_IMG_SIGNATURE, NURU_STR_LEN);
+	img->version    = NURU_IMG_VERSION;
+	img->glyph_mode = head[8];
+	img->color_mode = head[9];
+	img->mdata_mode = head[10];
+	img->ch_key     = head[11];
+	img->fg_key     = head[12];
+	img->bg_key     = head[13];
+	memcpy(img->glyph_pal, head + 14, NURU_STR_LEN_RAW);
+	memcpy(img->color_pal, head + 21, NURU_STR_LEN_RAW);
+	t->tile_w       = (head[28] << 8) | head[29];
+	t->tile_h       = (head[30] << 8) | head[31];
+	t->num_levels   = head[32];
+
+	int cell_size = nuru_img_cell_size(img);
+	if (cell_size == -1)
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_FILE_MODE;
+	}
+	if (t->tile_w == 0 || t->tile_h == 0 || t->num_levels == 0 || t->num_levels > NURU_TILE_MAX_LEVELS)
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_FILE_TYPE;
+	}
+
+	// level dimensions, then their offset tables
+	uint8_t lvs[NURU_TILE_MAX_LEVELS * NURU_TILE_LEVEL_SIZE];
+	size_t lvs_len = t->num_levels * NURU_TILE_LEVEL_SIZE;
+	if (pread(t->fd, lvs, lvs_len, NURU_TILE_HEAD_SIZE) != (ssize_t) lvs_len)
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_FILE_READ;
+	}
+
+	// tiles are never larger than the canvas, so neither are our buffers; 
+	// as there's only one column (row) of tiles either way, the layout stays
+	uint32_t cols = nuru_tile_get32(lvs);
+	uint32_t rows = nuru_tile_get32(lvs + 4);
+	if (cols == 0 || rows == 0)
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_FILE_TYPE;
+	}
+	t->tile_w = cols < t->tile_w ? cols : t->tile_w;
+	t->tile_h = rows < t->tile_h ? rows : t->tile_h;
+	if ((size_t) t->tile_w * t->tile_h > NURU_MEM_BUDGET / sizeof(nuru_cell_s))
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_TOO_BIG;
+	}
+
+	// the other levels follow from the first, so they better say the same
+	nuru_tile_levels(t, cols, rows);
+	for (int l = 1; l < t->num_levels; ++l)
+	{
+		const uint8_t* lv = lvs + l * NURU_TILE_LEVEL_SIZE;
+		if (nuru_tile_get32(lv) != t->levels[l].cols || nuru_tile_get32(lv + 4) != t->levels[l].rows)
+		{
+			nuru_tiled_close(t);
+			return NURU_ERR_FILE_TYPE;
+		}
+	}
+
+	uint64_t size = st.st_size;
+	for (int l = 0; l < t->num_levels; ++l)
+	{
+		// the table has to fit in the file, which also keeps num * 8 in range
+		nuru_tile_level_s* lv = &t->levels[l];
+		uint64_t num = (uint64_t) lv->tiles_x * lv->tiles_y;
+		uint64_t pos = nuru_tile_table_pos(t, l);
+		if (pos > size || num > (size - pos) / 8)
+		{
+			nuru_tiled_close(t);
+			return NURU_ERR_FILE_SIZE;
+		}
+
+		uint8_t* raw = malloc(num * 8);
+		lv->offsets = malloc(num * sizeof(uint64_t));
+		if (raw == NULL || lv->offsets == NULL)
+		{
+			free(raw);
+			nuru_tiled_close(t);
+			return NURU_ERR_MEMORY;
+		}
+
+		ssize_t len = pread(t->fd, raw, num * 8, pos);
+		for (size_t i = 0; len == (ssize_t) (num * 8) && i < num; ++i)
+		{
+			lv->offsets[i] = nuru_tile_get64(raw + i * 8);
+		}
+		free(raw);
+		if (len != (ssize_t) (num * 8))
+		{
+			nuru_tiled_close(t);
+			return NURU_ERR_FILE_READ;
+		}
+
+		// as do the tiles themselves
+		for (size_t i = 0; i < num; ++i)
+		{
+			uint32_t w, h;
+			nuru_tile_dims(t, lv, i % lv->tiles_x, i / lv->tiles_x, &w, &h);
+			uint64_t tile_len = (uint64_t) w * h * cell_size;
+			if (lv->offsets[i] > size || tile_len > size - lv->offsets[i])
+			{
+				nuru_tiled_close(t);
+				return NURU_ERR_FILE_SIZE;
+			}
+		}
+	}
+
+	size_t tile_cells = (size_t) t->tile_w * t->tile_h;
+	t->num_slots = cache_tiles ? cache_tiles : NURU_TILE_CACHE_SIZE;
+	t->slots = calloc(t->num_slots, sizeof(nuru_tile_slot_s));
+	t->buf = malloc(tile_cells * cell_size + 1);
+	if (t->slots == NULL || t->buf == NULL)
+	{
+		nuru_tiled_close(t);
+		return NURU_ERR_MEMORY;
+	}
+	return 0;
+}
+
+/*
+ * Close a tiled image and free everything that was allocated for it.
+ */
+NURU_SCOPE int
+nuru_tiled_close(nuru_tiled_s* t)
+{
+	for (int l = 0; l < NURU_TILE_MAX_LEVELS; ++l)
+	{
+		free(t->levels[l].offsets);
+		t->levels[l].offsets = NULL;
+	}
+	for (size_t s = 0; t->slots && s < t->num_slots; ++s)
+	{
+		free(t->slots[s].cells);
+	}
+	free(t->slots);
+	free(t->buf);
+	t->slots = NULL;
+	t->buf = NULL;
+
+	if (t->fd >= 0)
+	{
+		close(t->fd);
+		t->fd = -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the decoded cells of a tile (tile_w cells per row), reading the tile
+ * from the file unless it is in the cache. If the cache is full, the least
+ * recently used tile makes room. The cells stay valid until the next call.
+ * Returns NULL if the tile doesn't exist or couldn't be read.
+ */
+NURU_SCOPE nuru_cell_s*
+nuru_tiled_tile(nuru_tiled_s* t, uint8_t level, uint64_t tile)
+{
+	if (level >= t->num_levels)
+	{
+		return NULL;
+	}
+	nuru_tile_level_s* lv = &t->levels[level];
+	if (tile >= (uint64_t) lv->tiles_x * lv->tiles_y)
+	{
+		return NULL;
+	}
+
+	// look for the tile, while keeping track of the slot to evict
+	nuru_tile_slot_s* lru = &t->slots[0];
+	++t->clock;
+	for (size_t s = 0; s < t->num_slots; ++s)
+	{
+		nuru_tile_slot_s* slot = &t->slots[s];
+		if (slot->valid && slot->level == level && slot->tile == tile)
+		{
+			++t->hits;
+			slot->used = t->clock;
+			return slot->cells;
+		}
+		if (!slot->valid || (lru->valid && slot->used < lru->used))
+		{
+			lru = slot;
+		}
+	}
+
+	++t->misses;
+	lru->valid = 0;
+	if (lru->cells == NULL)
+	{
+		lru->cells = malloc(sizeof(nuru_cell_s) * t->tile_w * t->tile_h);
+		if (lru->cells == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	uint32_t w, h;
+	nuru_tile_dims(t, lv, tile % lv->tiles_x, tile / lv->tiles_x, &w, &h);
+	size_t len = (size_t) w * h * nuru_img_cell_size(&t->head);
+	if (pread(t->fd, t->buf, len, lv->offsets[tile]) != (ssize_t) len)
+	{
+		return NULL;
+	}
+
+	const uint8_t* p = t->buf;
+	for (uint32_t y = 0; y < h; ++y)
+	{
+		nuru_cell_s* row = &lru->cells[(size_t) y * t->tile_w];
+		for (uint32_t x = 0; x < w; ++x)
+		{
+			p += nuru_get_cell(p, &t->head, &row[x]);
+		}
+	}
+
+	lru->level = level;
+	lru->tile  = tile;
+	lru->used  = t->clock;
+	lru->valid = 1;
+	return lru->cells;
+}
+
+/*
+ * Copy the region of `cols` by `rows` cells at (col, row) of the given level
+ * into `dst`, which becomes a regular nuru image that can be displayed as
+ * usual. Parts of the region outside the canvas are transparent. Only the
+ * tiles overlapping the region are read (or taken from the cache).
+ */
+NURU_SCOPE int
+nuru_tiled_get_region(nuru_tiled_s* t, uint8_t level, uint32_t col, uint32_t row,
+		uint16_t cols, uint16_t rows, nuru_img_s* dst)
+{
+	if (level >= t->num_levels)
+	{
+		return NURU_ERR_OTHER;
+	}
+	nuru_tile_level_s* lv = &t->levels[level];
+
+	// take over the header, but not the memory related fields
+	memcpy(dst->signature, t->head.signature, NURU_STR_LEN);
+	memcpy(dst->glyph_pal, t->head.glyph_pal, NURU_STR_LEN);
+	memcpy(dst->color_pal, t->head.color_pal, NURU_STR_LEN);
+	dst->version    = t->head.version;
+	dst->glyph_mode = t->head.glyph_mode;
+	dst->color_mode = t->head.color_mode;
+	dst->mdata_mode = t->head.mdata_mode;
+	dst->ch_key     = t->head.ch_key;
+	dst->fg_key     = t->head.fg_key;
+	dst->bg_key     = t->head.bg_key;
+	dst->cols       = cols;
+	dst->rows       = rows;
+	dst->num_cells  = (size_t) cols * rows;
+	if (nuru_img_reserve(dst, dst->num_cells) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
+
+	nuru_cell_s key = {
+		dst->glyph_mode == NURU_GLYPH_MODE_NONE ? NURU_SPACE : dst->ch_key,
+		dst->fg_key, dst->bg_key, 0
+	};
+	for (size_t c = 0; c < dst->num_cells; ++c)
+	{
+		dst->cells[c] = key;
+	}
+
+	// the part of the region that is on the canvas
+	uint64_t x1 = (uint64_t) col + cols < lv->cols ? (uint64_t) col + cols : lv->cols;
+	uint64_t y1 = (uint64_t) row + rows < lv->rows ? (uint64_t) row + rows : lv->rows;
+	if (col >= x1 || row >= y1)
+	{
+		return dst->num_cells;
+	}
+
+	for (uint32_t ty = row / t->tile_h; ty <= (y1 - 1) / t->tile_h; ++ty)
+	{
+		for (uint32_t tx = col / t->tile_w; tx <= (x1 - 1) / t->tile_w; ++tx)
+		{
+			nuru_cell_s* tile = nuru_tiled_tile(t, level, (uint64_t) ty * lv->tiles_x + tx);
+			if (tile == NULL)
+			{
+				return NURU_ERR_FILE_READ;
+			}
+
+			// intersection of tile and region, in canvas coordinates
+			uint64_t ax = (uint64_t) tx * t->tile_w > col ? (uint64_t) tx * t->tile_w : col;
+			uint64_t ay = (uint64_t) ty * t->tile_h > row ? (uint64_t) ty * t->tile_h : row;
+			uint64_t bx = (uint64_t) (tx + 1) * t->tile_w < x1 ? (uint64_t) (tx + 1) * t->tile_w : x1;
+			uint64_t by = (uint64_t) (ty + 1) * t->tile_h < y1 ? (uint64_t) (ty + 1) * t->tile_h : y1;
+
+			for (uint64_t y = ay; y < by; ++y)
+			{
+				nuru_cell_s* src = &tile[(y - (uint64_t) ty * t->tile_h) * t->tile_w + (ax - (uint64_t) tx * t->tile_w)];
+				nuru_cell_s* out = &dst->cells[(y - row) * cols + (ax - col)];
+				memcpy(out, src, sizeof(nuru_cell_s) * (bx - ax));
+			}
+		}
+	}
+	return dst->num_cells;
+}
+
+/*
+ * Copy a whole row of tiles of the given level into `cells`, `stride` cells 
+ * apart: tile_h rows (fewer for the last row of tiles) of the level's width. 
+ * This is for going through a level that is too wide for a nuru image.
+ */
+NURU_SCOPE int
+nuru_tiled_get_band(nuru_tiled_s* t, uint8_t level, uint32_t tile_y, nuru_cell_s* cells, size_t stride)
+{
+	if (level >= t->num_levels || tile_y >= t->levels[level].tiles_y)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	nuru_tile_level_s* lv = &t->levels[level];
+	for (uint32_t tx = 0; tx < lv->tiles_x; ++tx)
+	{
+		nuru_cell_s* tile = nuru_tiled_tile(t, level, (uint64_t) tile_y * lv->tiles_x + tx);
+		if (tile == NULL)
+		{
+			return NURU_ERR_FILE_READ;
+		}
+
+		uint32_t w, h;
+		nuru_tile_dims(t, lv, tx, tile_y, &w, &h);
+		for (uint32_t y = 0; y < h; ++y)
+		{
+			memcpy(&cells[y * stride + (size_t) tx * t->tile_w], &tile[(size_t) y * t->tile_w],
+					sizeof(nuru_cell_s) * w);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Create a tiled image file of `cols` by `rows` cells with `num_levels`
+ * levels, taking modes, keys and palette names from `head`. The header and
+ * a placeholder for the offset tables are written right away; after that,
+ * pass all cells to nuru_tiled_write_band(), then call nuru_tiled_finish().
+ */
+NURU_SCOPE int
+nuru_tiled_create(nuru_tiled_s* t, const char* file, nuru_img_s* head,
+		uint32_t cols, uint32_t rows, uint16_t tile_w, uint16_t tile_h, uint8_t num_levels)
+{
+	*t = (nuru_tiled_s) { 0 };
+	t->fd = -1;                        // lest closing closes stdin
+	if (nuru_img_cell_size(head) == -1)
+	{
+		return NURU_ERR_FILE_MODE;
+	}
+	if (cols == 0 || rows == 0 || tile_w == 0 || tile_h == 0)
+	{
+		return NURU_ERR_OTHER;
+	}
+	if (num_levels == 0 || num_levels > NURU_TILE_MAX_LEVELS)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	t->head = *head;
+	t->head.cells = NULL;
+	t->tile_w = tile_w;
+	t->tile_h = tile_h;
+	t->num_levels = num_levels;
+	nuru_tile_levels(t, cols, rows);
+
+	for (int l = 0; l < num_levels; ++l)
+	{
+		nuru_tile_level_s* lv = &t->levels[l];
+		lv->offsets = calloc((size_t) lv->tiles_x * lv->tiles_y, sizeof(uint64_t));
+		if (lv->offsets == NULL)
+		{
+			nuru_tiled_close(t);
+			return NURU_ERR_MEMORY;
+		}
+	}
+
+	t->buf = malloc((size_t) tile_w * 6 + NURU_TILE_HEAD_SIZE);
+	t->fp = fopen(file, "wb");
+	if (t->buf == NULL || t->fp == NULL)
+	{
+		// closing clears t->buf, so decide what went wrong first
+		int err = t->buf ? NURU_ERR_FILE_OPEN : NURU_ERR_MEMORY;
+		if (t->fp)
+		{
+			fclose(t->fp);
+			t->fp = NULL;
+		}
+		nuru_tiled_close(t);
+		return err;
+	}
+
+	uint8_t* buf = t->buf;
+	size_t len = 0;
+	len += nuru_put_str(buf + len, NURU_TILE_SIGNATURE, NURU_STR_LEN_RAW);
+	len += nuru_put_int(buf + len, NURU_TILE_VERSION, 1);
+	len += nuru_put_int(buf + len, head->glyph_mode, 1);
+	len += nuru_put_int(buf + len, head->color_mode, 1);
+	len += nuru_put_int(buf + len, head->mdata_mode, 1);
+	len += nuru_put_int(buf + len, head->ch_key, 1);
+	len += nuru_put_int(buf + len, head->fg_key, 1);
+	len += nuru_put_int(buf + len, head->bg_key, 1);
+	len += nuru_put_str(buf + len, head->glyph_pal, NURU_STR_LEN_RAW);
+	len += nuru_put_str(buf + len, head->color_pal, NURU_STR_LEN_RAW);
+	len += nuru_put_int(buf + len, tile_w, 2);
+	len += nuru_put_int(buf + len, tile_h, 2);
+	len += nuru_put_int(buf + len, num_levels, 1);
+	len += nuru_put_str(buf + len, "", NURU_TILE_HEAD_SIZE - len);
+
+	int errors = fwrite(buf, 1, len, t->fp) != len;
+	for (int l = 0; l < num_levels; ++l)
+	{
+		uint8_t lv[NURU_TILE_LEVEL_SIZE];
+		nuru_tile_put32(lv, t->levels[l].cols);
+		nuru_tile_put32(lv + 4, t->levels[l].rows);
+		errors += fwrite(lv, 1, sizeof(lv), t->fp) != sizeof(lv);
+	}
+
+	// the offset tables are written for real by nuru_tiled_finish()
+	errors += fseeko(t->fp, nuru_tile_table_pos(t, num_levels), SEEK_SET) != 0;
+	if (errors)
+	{
+		fclose(t->fp);
+		nuru_tiled_close(t);
+		return NURU_ERR_FILE_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * Write the next band of cells of the given level: tile_h rows (fewer for 
+ * the last band) of the level's width, `stride` cells apart. The bands of 
+ * each level have to be written top to bottom, but levels can be mixed.
+ */
+NURU_SCOPE int
+nuru_tiled_write_band(nuru_tiled_s* t, uint8_t level, nuru_cell_s* cells, size_t stride)
+{
+	if (level >= t->num_levels || t->levels[level].next_y == t->levels[level].tiles_y)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	nuru_tile_level_s* lv = &t->levels[level];
+	int errors = 0;
+	for (uint32_t tx = 0; tx < lv->tiles_x; ++tx)
+	{
+		uint32_t w, h;
+		nuru_tile_dims(t, lv, tx, lv->next_y, &w, &h);
+		lv->offsets[(size_t) lv->next_y * lv->tiles_x + tx] = ftello(t->fp);
+
+		for (uint32_t y = 0; y < h; ++y)
+		{
+			nuru_cell_s* row = &cells[y * stride + (size_t) tx * t->tile_w];
+			size_t len = 0;
+			for (uint32_t x = 0; x < w; ++x)
+			{
+				len += nuru_put_cell(t->buf + len, &t->head, &row[x]);
+			}
+			errors += fwrite(t->buf, 1, len, t->fp) != len;
+		}
+	}
+
+	lv->next_y++;
+	return errors ? NURU_ERR_FILE_WRITE : 0;
+}
+
+/*
+ * Write the offset tables and close the file. Fails if not all levels have
+ * been written completely.
+ */
+NURU_SCOPE int
+nuru_tiled_finish(nuru_tiled_s* t)
+{
+	int errors = fseeko(t->fp, nuru_tile_table_pos(t, 0), SEEK_SET) != 0;
+	for (int l = 0; l < t->num_levels; ++l)
+	{
+		nuru_tile_level_s* lv = &t->levels[l];
+		size_t num = (size_t) lv->tiles_x * lv->tiles_y;
+		errors += lv->next_y != lv->tiles_y;
+		for (size_t i = 0; i < num; ++i)
+		{
+			uint8_t raw[8];
+			nuru_tile_put64(raw, lv->offsets[i]);
+			errors += fwrite(raw, 1, sizeof(raw), t->fp) != sizeof(raw);
+		}
+	}
+
+	errors += fclose(t->fp) != 0;
+	t->fp = NULL;
+	nuru_tiled_close(t);
+	return errors ? NURU_ERR_FILE_WRITE : 0;
+}
+
+#endif /* NURU_IMPLEMENTATION */
+#endif /* NURU_TILE_H */
@@ -6,6 +6,8 @@
 #include <string.h>     // strcmp()
 #include <ctype.h>      // isalnum()
 #include <arpa/inet.h>  // ntohs()
+#include <time.h>       // clock_gettime()
+#include <sys/stat.h>   // fstat()
 
 #define NURU_NAME "nuru"
 #define NURU_URL  "https://github.com/domsson/nuru"
@@ -34,6 +36,16 @@
 #define NURU_STR_LEN_RAW 7
 #define NURU_PAL_SIZE 256
 
+#define NURU_IMG_VERSION   2     // image format version written by us
+#define NURU_IMG_HEAD_SIZE 32    // bytes of image header in a file
+#define NURU_IMG_SUM_SIZE  4     // bytes of payload checksum after the header (v2+)
+#define NURU_PAL_HEAD_SIZE 16    // bytes of palette header in a file
+#define NURU_BUF_SIZE      16384 // bytes buffered when writing files
+#define NURU_MEM_BUDGET    (256UL << 20) // default max bytes of cells to load
+
+#define NURU_QUANT_BITS    5     // bits per channel in the quantizer's cube
+#define NURU_QUANT_SIZE    (1 << NURU_QUANT_BITS)
+
 #define NURU_ERR_NONE        0
 #define NURU_ERR_OTHER      -1
 #define NURU_ERR_MEMORY     -2
@@ -44,6 +56,20 @@
 #define NURU_ERR_IMG_VER    -7
 #define NURU_ERR_PAL_VER    -8
 #define NURU_ERR_PAL_TYPE   -9
+#define NURU_ERR_FILE_WRITE -10
+#define NURU_ERR_CHECKSUM   -11
+#define NURU_ERR_FILE_SIZE  -12
+#define NURU_ERR_TOO_BIG    -13
+
+// meta data bits that renderers show as text attributes
+
+#define NURU_MD_BOLD       0x01
+#define NURU_MD_FAINT      0x02
+#define NURU_MD_ITALIC     0x04
+#define NURU_MD_UNDERLINE  0x08
+#define NURU_MD_BLINK      0x10
+#define NURU_MD_REVERSE    0x20
+#define NURU_MD_ATTRS      0x3f  // all of the above
 
 typedef enum nuru_glyph_mode
 {
@@ -97,6 +123,14 @@ typedef struct nuru_rgb
 }
 nuru_rgb_s;
 
+typedef struct nuru_alloc
+{
+	void* (*realloc)(void *ctx, void *ptr, size_t size); // like realloc()
+	void  (*free)(void *ctx, void *ptr);                 // like free()
+	void*   ctx;                                         // passed to the above
+}
+nuru_alloc_s;
+
 typedef struct nuru_img
 {
 	char     signature[NURU_STR_LEN];
@@ -111,9 +145,19 @@ typedef struct nuru_img
 	uint8_t  bg_key;
 	char     glyph_pal[NURU_STR_LEN];
 	char     color_pal[NURU_STR_LEN];
+	uint32_t checksum;     // nuru_hash of the payload, only in version 2+
 
 	nuru_cell_s *cells;
 	size_t num_cells;
+	size_t cap_cells;      // number of cells allocated, kept across loads
+	uint8_t cells_ext;     // cells are caller-supplied, never (re)allocated
+	nuru_alloc_s *alloc;   // allocator for cells, NULL for realloc()/free()
+	size_t mem_budget;     // max bytes of cells to load, 0 for NURU_MEM_BUDGET
+
+	uint8_t hash_rows;     // compute row_hashes while loading the cells
+	uint32_t *row_hashes;  // hash of each row's cells, see nuru_img_row_hash()
+	size_t cap_rows;       // number of row hashes allocated, kept across loads
+	uint8_t hashes_valid;  // row_hashes match the cells, cleared on load/reserve
 }
 nuru_img_s;
 
@@ -135,15 +179,99 @@ typedef struct nuru_pal
 }
 nuru_pal_s;
 
+typedef struct nuru_quant
+{
+	nuru_rgb_s rgbs[NURU_PAL_SIZE]; // colors to quantize to
+	int num_rgbs;                   // number of colors in rgbs
+	uint8_t cube[NURU_QUANT_SIZE * NURU_QUANT_SIZE * NURU_QUANT_SIZE];
+}
+nuru_quant_s;
+
+typedef struct nuru_stats
+{
+	uint64_t load_ns;      // time spent opening the file and reading the header
+	uint64_t decode_ns;    // time spent reading and decoding the payload
+	uint64_t render_ns;    // time spent rendering, filled in by the renderer
+	size_t   cells;        // number of cells rendered
+	size_t   out_bytes;    // total number of bytes of output
+	size_t   esc_bytes;    // bytes of output spent on escape sequences
+	size_t   glyph_bytes;  // bytes of output spent on glyphs and line breaks
+	size_t   sgr_changes;  // number of SGR sequences emitted
+	size_t   writes;       // number of write syscalls
+}
+nuru_stats_s;
+
+typedef struct nuru_hash
+{
+	uint32_t acc[4];       // accumulators, one per 4 byte lane of a stripe
+	uint8_t  buf[16];      // bytes not yet making up a full 16 byte stripe
+	size_t   buf_len;      // number of bytes in buf
+	uint64_t len;          // total number of bytes hashed
+}
+nuru_hash_s;
+
+/*
+ * Accumulates all source cells that make up one cell of a scaled image.
+ * Index 0 is for the foreground, index 1 for the background color.
+ */
+typedef struct nuru_acc
+{
+	uint64_t r[2], g[2], b[2]; // sums of the opaque colors' RGB values
+	uint32_t num[2];           // number of opaque colors
+	uint32_t keys[2];          // number of transparent (key) colors
+	uint8_t  first[2];         // first opaque color index encountered
+	uint8_t  mixed[2];         // opaque colors differ from the first one
+	uint16_t ch;               // majority vote (Boyer-Moore) for the glyph
+	uint16_t md;               // majority vote (Boyer-Moore) for the meta data
+	uint32_t ch_votes;         // the glyph vote's current lead
+	uint32_t md_votes;         // the meta data vote's current lead
+}
+nuru_acc_s;
+
+// `img` has to be zero-initialized (nuru_img_s img = { 0 };) before it is 
+// first loaded into, as the cells of a previous load are reused; it can then 
+// be loaded into again and again, and is freed with nuru_img_free()
 NURU_SCOPE int nuru_img_load(nuru_img_s *img, const char *file);
+NURU_SCOPE int nuru_img_load_header(nuru_img_s *img, const char *file);
+NURU_SCOPE int nuru_img_validate(nuru_img_s *img, const char *file);
+NURU_SCOPE int nuru_img_load_stats(nuru_img_s *img, const char *file, nuru_stats_s *stats);
+NURU_SCOPE int nuru_img_load_mem(nuru_img_s *img, const void *buf, size_t len, nuru_stats_s *stats);
 NURU_SCOPE int nuru_img_free(nuru_img_s *img);
+NURU_SCOPE int nuru_img_reserve(nuru_img_s *img, size_t num_cells);
+NURU_SCOPE int nuru_img_use_cells(nuru_img_s *img, nuru_cell_s *cells, size_t cap);
 NURU_SCOPE int nuru_pal_load(nuru_pal_s *pal, const char *file);
+NURU_SCOPE int nuru_img_save(nuru_img_s *img, const char *file);
+NURU_SCOPE int nuru_pal_save(nuru_pal_s *pal, const char *file);
+NURU_SCOPE int nuru_img_cell_size(nuru_img_s *img);
+NURU_SCOPE int nuru_img_head_size(nuru_img_s *img);
+NURU_SCOPE int64_t nuru_img_payload_size(nuru_img_s *img);
+
+NURU_SCOPE int nuru_img_rgbs(nuru_img_s *img, nuru_pal_s *pal, nuru_rgb_s *rgbs);
+NURU_SCOPE int nuru_img_scale(nuru_img_s *dst, nuru_img_s *src, uint16_t cols, uint16_t rows, nuru_pal_s *pal);
+NURU_SCOPE void nuru_acc_cell(nuru_acc_s *acc, nuru_cell_s *cell, nuru_img_s *img, nuru_rgb_s *rgbs);
+NURU_SCOPE void nuru_acc_get(nuru_acc_s *acc, nuru_cell_s *cell, nuru_img_s *img, nuru_rgb_s *rgbs, int num_rgbs);
 
 NURU_SCOPE nuru_cell_s* nuru_img_get_cell(nuru_img_s *img, uint16_t col, uint16_t row);
+
+NURU_SCOPE uint32_t     nuru_img_row_hash(nuru_img_s *img, uint16_t row);
+NURU_SCOPE int          nuru_img_hash_rows(nuru_img_s *img);
+NURU_SCOPE int          nuru_img_diff_rows(nuru_img_s *a, nuru_img_s *b, uint8_t *changed);
+NURU_SCOPE int          nuru_img_diff_span(nuru_img_s *a, nuru_img_s *b, uint16_t row, uint16_t *first, uint16_t *last);
 NURU_SCOPE uint8_t      nuru_pal_get_col_8bit(nuru_pal_s *pal, uint8_t idx);
 NURU_SCOPE uint16_t     nuru_pal_get_glyph(nuru_pal_s *pal, uint8_t idx);
 NURU_SCOPE nuru_rgb_s*  nuru_pal_get_col_rgb(nuru_pal_s *pal, uint8_t idx);
 
+NURU_SCOPE int          nuru_quant_init(nuru_quant_s *q, nuru_rgb_s *rgbs, int num, int skip);
+NURU_SCOPE uint8_t      nuru_quant_idx(nuru_quant_s *q, nuru_rgb_s *rgb);
+
+NURU_SCOPE void         nuru_hash_init(nuru_hash_s *h);
+NURU_SCOPE void         nuru_hash_update(nuru_hash_s *h, const void *data, size_t len);
+NURU_SCOPE uint32_t     nuru_hash_final(nuru_hash_s *h);
+
+NURU_SCOPE void         nuru_ansi_to_rgb(uint8_t idx, nuru_rgb_s *rgb);
+NURU_SCOPE uint8_t      nuru_rgb_to_ansi_8bit(nuru_rgb_s *rgb);
+NURU_SCOPE uint8_t      nuru_rgb_to_ansi_4bit(nuru_rgb_s *rgb);
+
 // 
 // IMPLEMENTATION
 // 
@@ -244,26 +372,145 @@ nuru_read_str(char* buf, size_t len, FILE* fp)
 	return 0;
 }
 
-NURU_SCOPE int
-nuru_img_load(nuru_img_s* img, const char* file)
+/*
+ * Payload checksums are XXH32 (seed 0): a 32 bit hash that processes 16 byte 
+ * stripes in four independent lanes, so it keeps up with reading the file.
+ */
+#define NURU_HASH_P1 2654435761U
+#define NURU_HASH_P2 2246822519U
+#define NURU_HASH_P3 3266489917U
+#define NURU_HASH_P4  668265263U
+#define NURU_HASH_P5  374761393U
+
+NURU_SCOPE uint32_t
+nuru_hash_rotl(uint32_t v, int n)
 {
-	// open file
-	FILE* fp = fopen(file, "rb");
-	if (fp == NULL)
+	return (v << n) | (v >> (32 - n));
+}
+
+NURU_SCOPE uint32_t
+nuru_hash_read32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+NURU_SCOPE uint32_t
+nuru_hash_round(uint32_t acc, uint32_t v)
+{
+	return nuru_hash_rotl(acc + v * NURU_HASH_P2, 13) * NURU_HASH_P1;
+}
+
+NURU_SCOPE void
+nuru_hash_stripe(nuru_hash_s* h, const uint8_t* p)
+{
+	h->acc[0] = nuru_hash_round(h->acc[0], nuru_hash_read32(p));
+	h->acc[1] = nuru_hash_round(h->acc[1], nuru_hash_read32(p + 4));
+	h->acc[2] = nuru_hash_round(h->acc[2], nuru_hash_read32(p + 8));
+	h->acc[3] = nuru_hash_round(h->acc[3], nuru_hash_read32(p + 12));
+}
+
+NURU_SCOPE void
+nuru_hash_init(nuru_hash_s* h)
+{
+	*h = (nuru_hash_s) { 0 };
+	h->acc[0] = NURU_HASH_P1 + NURU_HASH_P2;
+	h->acc[1] = NURU_HASH_P2;
+	h->acc[2] = 0;
+	h->acc[3] = 0 - NURU_HASH_P1;
+}
+
+/*
+ * Feed `len` bytes of data into the hash; can be called any number of times.
+ */
+NURU_SCOPE void
+nuru_hash_update(nuru_hash_s* h, const void* data, size_t len)
+{
+	const uint8_t* p = data;
+	h->len += len;
+
+	// complete a stripe left over from last time
+	if (h->buf_len)
 	{
-		return NURU_ERR_FILE_OPEN;
+		size_t n = 16 - h->buf_len < len ? 16 - h->buf_len : len;
+		memcpy(h->buf + h->buf_len, p, n);
+		h->buf_len += n;
+		p += n;
+		len -= n;
+		if (h->buf_len < 16)
+		{
+			return;
+		}
+		nuru_hash_stripe(h, h->buf);
+		h->buf_len = 0;
+	}
+
+	for (; len >= 16; p += 16, len -= 16)
+	{
+		nuru_hash_stripe(h, p);
+	}
+
+	memcpy(h->buf, p, len);
+	h->buf_len = len;
+}
+
+/*
+ * Get the hash of all the data fed in so far.
+ */
+NURU_SCOPE uint32_t
+nuru_hash_final(nuru_hash_s* h)
+{
+	uint32_t v = h->len >= 16 ?
+		nuru_hash_rotl(h->acc[0], 1)  + nuru_hash_rotl(h->acc[1], 7) +
+		nuru_hash_rotl(h->acc[2], 12) + nuru_hash_rotl(h->acc[3], 18) :
+		h->acc[2] + NURU_HASH_P5;
+	v += (uint32_t) h->len;
+
+	const uint8_t* p = h->buf;
+	size_t len = h->buf_len;
+	for (; len >= 4; p += 4, len -= 4)
+	{
+		v = nuru_hash_rotl(v + nuru_hash_read32(p) * NURU_HASH_P3, 17) * NURU_HASH_P4;
+	}
+	for (; len > 0; ++p, --len)
+	{
+		v = nuru_hash_rotl(v + (*p) * NURU_HASH_P5, 11) * NURU_HASH_P1;
 	}
 
+	v ^= v >> 15;
+	v *= NURU_HASH_P2;
+	v ^= v >> 13;
+	v *= NURU_HASH_P3;
+	v ^= v >> 16;
+	return v;
+}
+
+/*
+ * Get a monotonic timestamp, in nanoseconds.
+ */
+NURU_SCOPE uint64_t
+nuru_time_ns()
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Read the image header (everything up to the payload) from `fp`.
+ */
+NURU_SCOPE int
+nuru_img_read_head(nuru_img_s* img, FILE* fp)
+{
+	img->hashes_valid = 0;
+
 	// read signature
 	if (nuru_read_str(img->signature, NURU_STR_LEN_RAW, fp) != 0)
 	{
-		fclose(fp);
 		return NURU_ERR_FILE_READ;
 	}
 
 	if (strcmp(img->signature, NURU_IMG_SIGNATURE) != 0)
 	{
-		fclose(fp);
 		return NURU_ERR_FILE_TYPE;
 	}
 
@@ -280,206 +527,1350 @@ nuru_img_load(nuru_img_s* img, const char* file)
 	errors += nuru_read_str(img->glyph_pal, NURU_STR_LEN_RAW, fp);
 	errors += nuru_read_str(img->color_pal, NURU_STR_LEN_RAW, fp);
 
-	if (errors > 0)
+	if (errors != 0)
 	{
-		fclose(fp);
 		return NURU_ERR_FILE_READ;
 	}
 
-	// read payload
-	img->num_cells = img->cols * img->rows;
-	img->cells = malloc(sizeof(nuru_cell_s) * img->num_cells);
-	if (img->cells == NULL)
+	if (img->version > NURU_IMG_VERSION)
 	{
-		fclose(fp);
-		return NURU_ERR_MEMORY;
+		return NURU_ERR_IMG_VER;
 	}
 
-	for (size_t c = 0; c < img->num_cells; ++c)
+	// version 2 added the payload checksum
+	img->checksum = 0;
+	if (img->version >= 2)
 	{
-		img->cells[c] = (nuru_cell_s) { 0 };
-		switch (img->glyph_mode)
-		{
-			case NURU_GLYPH_MODE_NONE:
-				img->cells[c].ch = NURU_SPACE;
-				break;
-			case NURU_GLYPH_MODE_ASCII:
-			case NURU_GLYPH_MODE_PALETTE:
-				errors += nuru_read_int(&img->cells[c].ch, 1, fp);
-				break;
-			case NURU_GLYPH_MODE_UNICODE:
-				errors += nuru_read_int(&img->cells[c].ch, 2, fp);
-				break;
-			default:
-				fclose(fp);
-				return NURU_ERR_FILE_MODE;
-		}
-
-		switch(img->color_mode)
-		{
-			case NURU_COLOR_MODE_NONE:
-				img->cells[c].fg = 0;
-				img->cells[c].bg = 0;
-				break;
-			case NURU_COLOR_MODE_4BIT:
-				errors += nuru_read_col(&img->cells[c].fg, &img->cells[c].bg, fp);
-				break;
-			case NURU_COLOR_MODE_8BIT:
-			case NURU_COLOR_MODE_PALETTE:
-				errors += nuru_read_int(&img->cells[c].fg, 1, fp);
-				errors += nuru_read_int(&img->cells[c].bg, 1, fp);
-				break;
-			default:
-				fclose(fp);
-				return NURU_ERR_FILE_MODE;
-		}
-
-		switch(img->mdata_mode)
-		{
-			case NURU_MDATA_MODE_NONE:
-				img->cells[c].md = 0;
-				break;
-			case NURU_MDATA_MODE_1BYTE:
-				errors += nuru_read_int(&img->cells[c].md, 1, fp);
-				break;
-			case NURU_MDATA_MODE_2BYTE:
-				errors += nuru_read_int(&img->cells[c].md, 2, fp);
-				break;
-			default:
-				fclose(fp);
-				return NURU_ERR_FILE_MODE;
-		}
-
-		if (errors > 0)
+		uint8_t sum[NURU_IMG_SUM_SIZE];
+		if (fread(sum, 1, sizeof(sum), fp) != sizeof(sum))
 		{
-			fclose(fp);
 			return NURU_ERR_FILE_READ;
 		}
+		img->checksum = ((uint32_t) sum[0] << 24) | (sum[1] << 16) | (sum[2] << 8) | sum[3];
 	}
 
-	fclose(fp);
-	return img->num_cells;
+	return 0;
 }
 
-NURU_SCOPE nuru_cell_s*
-nuru_img_get_cell(nuru_img_s* img, uint16_t col, uint16_t row)
+/*
+ * Make sure the image has room for `num_cells` cells. If the image already 
+ * has cells allocated from a previous load, those will be reused, and only 
+ * grown if necessary, so loading one image after another into the same 
+ * nuru_img_s doesn't need to allocate memory each time. If `img->alloc` is 
+ * set, it will be used instead of realloc(). Caller-supplied cells (see 
+ * nuru_img_use_cells()) are never grown; NURU_ERR_MEMORY if they are too few.
+ */
+NURU_SCOPE int
+nuru_img_reserve(nuru_img_s* img, size_t num_cells)
 {
-	size_t idx = (row * img->cols) + col;
-	if (idx >= img->num_cells)
+	img->hashes_valid = 0;
+	if (img->cells && img->cap_cells >= num_cells)
 	{
-		return NULL;
+		return 0;
 	}
-	return &img->cells[idx];
-}
 
-NURU_SCOPE int
-nuru_img_free(nuru_img_s* img)
-{
-	if (!img)
+	if (img->cells_ext)
 	{
-		return NURU_ERR_OTHER;
+		return NURU_ERR_MEMORY;
 	}
-	if (!img->cells)
+
+	if (num_cells > SIZE_MAX / sizeof(nuru_cell_s))
 	{
-		return NURU_ERR_OTHER;
+		return NURU_ERR_MEMORY;
 	}
 
-	free(img->cells);
-	img->cells = NULL;
+	size_t size = sizeof(nuru_cell_s) * num_cells;
+	nuru_cell_s* cells = img->alloc ?
+		img->alloc->realloc(img->alloc->ctx, img->cells, size) :
+		realloc(img->cells, size);
+	if (cells == NULL)
+	{
+		return NURU_ERR_MEMORY;
+	}
+
+	img->cells = cells;
+	img->cap_cells = num_cells;
 	return 0;
 }
 
-NURU_SCOPE uint8_t
-nuru_pal_get_col_8bit(nuru_pal_s* pal, uint8_t idx)
+/*
+ * Make sure there's room for a hash of each of the image's rows.
+ */
+NURU_SCOPE int
+nuru_img_reserve_rows(nuru_img_s* img)
 {
-	return pal->data.colors[idx];
+	img->hashes_valid = 0;
+	if (img->row_hashes && img->cap_rows >= img->rows)
+	{
+		return 0;
+	}
+
+	size_t size = sizeof(uint32_t) * (img->rows ? img->rows : 1);
+	uint32_t* hashes = img->alloc ?
+		img->alloc->realloc(img->alloc->ctx, img->row_hashes, size) :
+		realloc(img->row_hashes, size);
+	if (hashes == NULL)
+	{
+		return NURU_ERR_MEMORY;
+	}
+
+	img->row_hashes = hashes;
+	img->cap_rows = img->rows;
+	return 0;
 }
 
-NURU_SCOPE uint16_t
-nuru_pal_get_glyph(nuru_pal_s* pal, uint8_t idx)
+/*
+ * Decode a cell from `buf`, according to the image's modes; the counterpart 
+ * of nuru_put_cell(). Returns the number of bytes read.
+ */
+NURU_SCOPE size_t
+nuru_get_cell(const uint8_t* buf, nuru_img_s* img, nuru_cell_s* cell)
 {
-	return pal->data.glyphs[idx];
+	size_t len = 0;
+	*cell = (nuru_cell_s) { 0 };
+	switch (img->glyph_mode)
+	{
+		case NURU_GLYPH_MODE_NONE:
+			cell->ch = NURU_SPACE;
+			break;
+		case NURU_GLYPH_MODE_ASCII:
+		case NURU_GLYPH_MODE_PALETTE:
+			cell->ch = buf[len++];
+			break;
+		case NURU_GLYPH_MODE_UNICODE:
+			cell->ch = (buf[len] << 8) | buf[len + 1];
+			len += 2;
+			break;
+	}
+	switch (img->color_mode)
+	{
+		case NURU_COLOR_MODE_4BIT:
+			cell->fg = (0xF0 & buf[len]) >> 4;
+			cell->bg = (0x0F & buf[len]);
+			len += 1;
+			break;
+		case NURU_COLOR_MODE_8BIT:
+		case NURU_COLOR_MODE_PALETTE:
+			cell->fg = buf[len++];
+			cell->bg = buf[len++];
+			break;
+	}
+	switch (img->mdata_mode)
+	{
+		case NURU_MDATA_MODE_1BYTE:
+			cell->md = buf[len++];
+			break;
+		case NURU_MDATA_MODE_2BYTE:
+			cell->md = (buf[len] << 8) | buf[len + 1];
+			len += 2;
+			break;
+	}
+	return len;
 }
 
-NURU_SCOPE nuru_rgb_s*
-nuru_pal_get_col_rgb(nuru_pal_s* pal, uint8_t idx)
+/*
+ * Read the next chunk of the payload, at most `len` bytes, into `buf`, 
+ * feeding it to the hash if the image has a checksum. Returns the number of 
+ * bytes read, NURU_ERR_FILE_SIZE if the file ended early.
+ */
+NURU_SCOPE long
+nuru_img_read_chunk(nuru_img_s* img, uint8_t* buf, size_t len, nuru_hash_s* h, FILE* fp)
 {
-	return &pal->data.rgbs[idx];
+	size_t n = fread(buf, 1, len, fp);
+	if (n != len)
+	{
+		return ferror(fp) ? NURU_ERR_FILE_READ : NURU_ERR_FILE_SIZE;
+	}
+	if (img->version >= 2)
+	{
+		nuru_hash_update(h, buf, n);
+	}
+	return n;
 }
 
+/*
+ * Allocate the cells and read the image payload from `fp`. Expects the 
+ * header to have been read already. The payload is read in chunks, each of 
+ * which is hashed and decoded right away, so that the checksum (version 2+) 
+ * is verified without a second pass over the data.
+ *
+ * If `img->hash_rows` is set, every row gets hashed as soon as it has been 
+ * decoded, see nuru_img_row_hash().
+ *
+ * Before allocating anything, images whose cells would take up more than 
+ * the memory budget are rejected (NURU_ERR_TOO_BIG), as are files that are 
+ * too short to hold the payload the header promises (NURU_ERR_FILE_SIZE); 
+ * the latter can only be checked for regular files, though.
+ */
 NURU_SCOPE int
-nuru_pal_load(nuru_pal_s* pal, const char* file)
+nuru_img_read_body(nuru_img_s* img, FILE* fp)
 {
-	// open file
-	FILE* fp = fopen(file, "rb");
-	if (fp == NULL)
+	int cell_size = nuru_img_cell_size(img);
+	if (cell_size == -1)
 	{
-		return NURU_ERR_MEMORY;
+		return NURU_ERR_FILE_MODE;
 	}
 
-	// read signature
-	if (nuru_read_str(pal->signature, NURU_STR_LEN_RAW, fp) != 0)
+	size_t num_cells = (size_t) img->cols * img->rows;
+	size_t budget = img->mem_budget ? img->mem_budget : NURU_MEM_BUDGET;
+	if (num_cells > budget / sizeof(nuru_cell_s))
 	{
-		fclose(fp);
-		return NURU_ERR_FILE_READ;
+		return NURU_ERR_TOO_BIG;
 	}
-	
-	if (strcmp(pal->signature, NURU_PAL_SIGNATURE) != 0)
+
+	struct stat st;
+	long pos = ftell(fp);
+	int fd = fileno(fp);
+	if (pos >= 0 && fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
 	{
-		fclose(fp);
-		return NURU_ERR_FILE_TYPE;
+		if (st.st_size - pos < nuru_img_payload_size(img))
+		{
+			return NURU_ERR_FILE_SIZE;
+		}
 	}
 
-	int errors = 0;
-
-	// read rest of header
-	errors += nuru_read_int(&pal->version, 1, fp);
-	errors += nuru_read_int(&pal->type,    1, fp);
-	errors += nuru_read_int(&pal->ch_key,  1, fp);
-	errors += nuru_read_int(&pal->fg_key,  1, fp);
-	errors += nuru_read_int(&pal->bg_key,  1, fp);
-	errors += nuru_read_str(pal->userdata, 4, fp);
+	// read payload
+	img->num_cells = num_cells;
+	if (nuru_img_reserve(img, img->num_cells) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
+	if (img->hash_rows && nuru_img_reserve_rows(img) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
 
-	if (errors > 0)
+	// glyph mode none without colors has no payload at all
+	if (cell_size == 0)
 	{
-		fclose(fp);
-		return NURU_ERR_FILE_READ;
+		for (size_t c = 0; c < img->num_cells; ++c)
+		{
+			nuru_get_cell(NULL, img, &img->cells[c]);
+		}
+		return img->hash_rows ? nuru_img_hash_rows(img) : 0;
 	}
 
-	// read payload
-	for (int i = 0; i < NURU_PAL_SIZE; ++i)
+	nuru_hash_s h;
+	nuru_hash_init(&h);
+
+	uint8_t buf[NURU_BUF_SIZE];
+	size_t per_chunk = NURU_BUF_SIZE / cell_size;
+	uint32_t row = 0;
+	for (size_t c = 0; c < img->num_cells; )
 	{
-		if (pal->type == NURU_PAL_TYPE_COLOR_8BIT)
+		size_t num = img->num_cells - c < per_chunk ? img->num_cells - c : per_chunk;
+		long len = nuru_img_read_chunk(img, buf, num * cell_size, &h, fp);
+		if (len < 0)
 		{
-			if (nuru_read_int(&pal->data.colors[i], 1, fp) != 0)
-			{
-				fclose(fp);
-				return NURU_ERR_FILE_READ;
-			}
+			return len;
 		}
-		
-		if (pal->type == NURU_PAL_TYPE_GLYPH_UNICODE)
+
+		const uint8_t* p = buf;
+		for (size_t end = c + num; c < end; ++c)
 		{
-			if (nuru_read_int(&pal->data.glyphs[i], 2, fp) != 0)
-			{
-				fclose(fp);
-				return NURU_ERR_FILE_READ;
-			}
+			p += nuru_get_cell(p, img, &img->cells[c]);
 		}
 
-		if (pal->type == NURU_PAL_TYPE_COLOR_RGB)
+		// hash the rows completed by this chunk while they're still in cache
+		for (; img->hash_rows && (size_t) (row + 1) * img->cols <= c; ++row)
 		{
-			if (nuru_read_rgb(&pal->data.rgbs[i], fp) != 0)
-			{
-				fclose(fp);
-				return NURU_ERR_FILE_READ;
-			}
+			img->row_hashes[row] = nuru_img_row_hash(img, row);
 		}
 	}
 
-	fclose(fp);
+	if (img->version >= 2 && nuru_hash_final(&h) != img->checksum)
+	{
+		return NURU_ERR_CHECKSUM;
+	}
+	img->hashes_valid = img->hash_rows;
 	return 0;
 }
 
+/*
+ * Check the integrity of a nuru image file without decoding it: the payload 
+ * has to be exactly as long as the header says and, for version 2+, match 
+ * the checksum. The header is read into `img`, but no cells are allocated.
+ * Returns 0 if the file is fine, a negative error code otherwise.
+ */
+NURU_SCOPE int
+nuru_img_validate(nuru_img_s* img, const char* file)
+{
+	FILE* fp = fopen(file, "rb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	int err = nuru_img_read_head(img, fp);
+	if (err == 0 && nuru_img_cell_size(img) == -1)
+	{
+		err = NURU_ERR_FILE_MODE;
+	}
+
+	nuru_hash_s h;
+	nuru_hash_init(&h);
+
+	uint8_t buf[NURU_BUF_SIZE];
+	size_t left = err == 0 ? nuru_img_payload_size(img) : 0;
+	while (err == 0 && left > 0)
+	{
+		size_t len = left < NURU_BUF_SIZE ? left : NURU_BUF_SIZE;
+		long n = nuru_img_read_chunk(img, buf, len, &h, fp);
+		err = n < 0 ? n : 0;
+		left -= len;
+	}
+
+	// anything after the payload means the file isn't what it claims to be
+	if (err == 0 && fgetc(fp) != EOF)
+	{
+		err = NURU_ERR_FILE_SIZE;
+	}
+	if (err == 0 && img->version >= 2 && nuru_hash_final(&h) != img->checksum)
+	{
+		err = NURU_ERR_CHECKSUM;
+	}
+
+	fclose(fp);
+	return err;
+}
+
+/*
+ * Load the nuru image file into `img`, which has to be zero-initialized, or 
+ * have been loaded into before, as its cells (and row hashes) are reused and 
+ * only grown if need be, see nuru_img_reserve(). Options like `alloc`, 
+ * `mem_budget` and `hash_rows` are read from `img`, so set those before.
+ * Returns 0 on success, a negative error code otherwise.
+ */
+NURU_SCOPE int
+nuru_img_load(nuru_img_s* img, const char* file)
+{
+	return nuru_img_load_stats(img, file, NULL);
+}
+
+/*
+ * Load only the header of a nuru image file, leaving the cells of `img` as 
+ * they are. This reads just the header bytes (see nuru_img_head_size()), 
+ * which makes it the cheap way to get an image's dimensions, modes and 
+ * palette names. Returns 0 on success, a negative error code otherwise.
+ */
+NURU_SCOPE int
+nuru_img_load_header(nuru_img_s* img, const char* file)
+{
+	FILE* fp = fopen(file, "rb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	// don't let stdio read more than the header
+	char buf[NURU_IMG_HEAD_SIZE + NURU_IMG_SUM_SIZE];
+	setvbuf(fp, buf, _IOFBF, sizeof(buf));
+
+	int err = nuru_img_read_head(img, fp);
+	fclose(fp);
+	return err;
+}
+
+/*
+ * Same as nuru_img_load(), but if `stats` isn't NULL, the time it took to 
+ * load the header and decode the payload will be recorded in there.
+ */
+NURU_SCOPE int
+nuru_img_load_stats(nuru_img_s* img, const char* file, nuru_stats_s* stats)
+{
+	uint64_t t0 = stats ? nuru_time_ns() : 0;
+
+	// open file
+	FILE* fp = fopen(file, "rb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	int err = nuru_img_read_head(img, fp);
+	if (err != 0)
+	{
+		fclose(fp);
+		return err;
+	}
+
+	uint64_t t1 = stats ? nuru_time_ns() : 0;
+
+	err = nuru_img_read_body(img, fp);
+	fclose(fp);
+	if (err != 0)
+	{
+		return err;
+	}
+
+	if (stats)
+	{
+		stats->load_ns   = t1 - t0;
+		stats->decode_ns = nuru_time_ns() - t1;
+	}
+
+	return img->num_cells;
+}
+
+/*
+ * Same as nuru_img_load_stats(), but decodes the image from the `len` bytes 
+ * of file contents in `buf`, which the caller has read already, for example 
+ * ahead of time while the previous image was being displayed.
+ */
+NURU_SCOPE int
+nuru_img_load_mem(nuru_img_s* img, const void* buf, size_t len, nuru_stats_s* stats)
+{
+	uint64_t t0 = stats ? nuru_time_ns() : 0;
+
+	FILE* fp = fmemopen((void*) buf, len, "rb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	int err = nuru_img_read_head(img, fp);
+	if (err == 0 && (int64_t) len - nuru_img_head_size(img) < nuru_img_payload_size(img))
+	{
+		err = NURU_ERR_FILE_SIZE;
+	}
+	if (err != 0)
+	{
+		fclose(fp);
+		return err;
+	}
+
+	uint64_t t1 = stats ? nuru_time_ns() : 0;
+
+	err = nuru_img_read_body(img, fp);
+	fclose(fp);
+	if (err != 0)
+	{
+		return err;
+	}
+
+	if (stats)
+	{
+		stats->load_ns   = t1 - t0;
+		stats->decode_ns = nuru_time_ns() - t1;
+	}
+
+	return img->num_cells;
+}
+
+NURU_SCOPE nuru_cell_s*
+nuru_img_get_cell(nuru_img_s* img, uint16_t col, uint16_t row)
+{
+	size_t idx = ((size_t) row * img->cols) + col;
+	if (idx >= img->num_cells)
+	{
+		return NULL;
+	}
+	return &img->cells[idx];
+}
+
+/*
+ * Hash the decoded cells of the given row. The hash only tells apart rows of 
+ * images in memory; it depends on the platform and isn't meant to be stored.
+ */
+NURU_SCOPE uint32_t
+nuru_img_row_hash(nuru_img_s* img, uint16_t row)
+{
+	nuru_hash_s h;
+	nuru_hash_init(&h);
+	nuru_hash_update(&h, img->cells + (size_t) row * img->cols, sizeof(nuru_cell_s) * img->cols);
+	return nuru_hash_final(&h);
+}
+
+/*
+ * (Re)compute the hashes of all rows, for images whose cells didn't come 
+ * from loading a file with `hash_rows` set, or have been changed since.
+ */
+NURU_SCOPE int
+nuru_img_hash_rows(nuru_img_s* img)
+{
+	if (img->cells == NULL || img->num_cells < (size_t) img->cols * img->rows)
+	{
+		return NURU_ERR_OTHER;
+	}
+	if (nuru_img_reserve_rows(img) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
+	for (uint32_t r = 0; r < img->rows; ++r)
+	{
+		img->row_hashes[r] = nuru_img_row_hash(img, r);
+	}
+	img->hashes_valid = 1;
+	return 0;
+}
+
+/*
+ * Find the rows that differ between two images of the same size, typically 
+ * two frames of the same thing: `changed` gets a 1 for every row that does, 
+ * a 0 for every row that doesn't. If both images have up-to-date row hashes 
+ * (`hashes_valid`), only those are compared (a collision goes unnoticed, at 
+ * odds of 1 in 2^32 per row), otherwise the cells are. Returns the number of 
+ * changed rows, or an error.
+ */
+NURU_SCOPE int
+nuru_img_diff_rows(nuru_img_s* a, nuru_img_s* b, uint8_t* changed)
+{
+	if (a->cols != b->cols || a->rows != b->rows || !a->cells || !b->cells)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	int hashed = a->hashes_valid && a->row_hashes && b->hashes_valid && b->row_hashes;
+	size_t row_size = sizeof(nuru_cell_s) * a->cols;
+
+	int num = 0;
+	for (uint32_t r = 0; r < a->rows; ++r)
+	{
+		changed[r] = hashed ? a->row_hashes[r] != b->row_hashes[r] :
+			memcmp(a->cells + r * a->cols, b->cells + r * b->cols, row_size) != 0;
+		num += changed[r];
+	}
+	return num;
+}
+
+/*
+ * Find the first and last column in which the given row differs between two 
+ * images of the same width, so that only that span needs to be redrawn. 
+ * Returns 1 if the row differs, 0 if it doesn't (leaving the span as is).
+ */
+NURU_SCOPE int
+nuru_img_diff_span(nuru_img_s* a, nuru_img_s* b, uint16_t row, uint16_t* first, uint16_t* last)
+{
+	if (a->cols != b->cols || row >= a->rows || row >= b->rows)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	nuru_cell_s* ca = a->cells + (size_t) row * a->cols;
+	nuru_cell_s* cb = b->cells + (size_t) row * b->cols;
+	uint32_t l = 0;
+	uint32_t r = a->cols;
+	while (l < r && memcmp(&ca[l], &cb[l], sizeof(nuru_cell_s)) == 0)
+	{
+		++l;
+	}
+	if (l == r)
+	{
+		return 0;
+	}
+	while (r > l && memcmp(&ca[r - 1], &cb[r - 1], sizeof(nuru_cell_s)) == 0)
+	{
+		--r;
+	}
+	*first = l;
+	*last = r - 1;
+	return 1;
+}
+
+NURU_SCOPE int
+nuru_img_free(nuru_img_s* img)
+{
+	if (!img)
+	{
+		return NURU_ERR_OTHER;
+	}
+	if (img->row_hashes)
+	{
+		if (img->alloc)
+		{
+			img->alloc->free(img->alloc->ctx, img->row_hashes);
+		}
+		else
+		{
+			free(img->row_hashes);
+		}
+		img->row_hashes = NULL;
+		img->cap_rows = 0;
+		img->hashes_valid = 0;
+	}
+	if (!img->cells)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	if (img->cells_ext)
+	{
+		img->cells_ext = 0;
+	}
+	else if (img->alloc)
+	{
+		img->alloc->free(img->alloc->ctx, img->cells);
+	}
+	else
+	{
+		free(img->cells);
+	}
+	img->cells = NULL;
+	img->cap_cells = 0;
+	return 0;
+}
+
+/*
+ * Have the image use the given memory for its cells, which has to be large 
+ * enough for `cap` cells. The image will never reallocate or free it, hence 
+ * loading an image that needs more cells than that will fail. Any cells the 
+ * image allocated itself before will be freed.
+ */
+NURU_SCOPE int
+nuru_img_use_cells(nuru_img_s* img, nuru_cell_s* cells, size_t cap)
+{
+	if (!img || !cells)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	if (img->cells)
+	{
+		nuru_img_free(img);
+	}
+
+	img->cells = cells;
+	img->cap_cells = cap;
+	img->cells_ext = 1;
+	img->hashes_valid = 0;
+	return 0;
+}
+
+NURU_SCOPE uint8_t
+nuru_pal_get_col_8bit(nuru_pal_s* pal, uint8_t idx)
+{
+	return pal->data.colors[idx];
+}
+
+NURU_SCOPE uint16_t
+nuru_pal_get_glyph(nuru_pal_s* pal, uint8_t idx)
+{
+	return pal->data.glyphs[idx];
+}
+
+NURU_SCOPE nuru_rgb_s*
+nuru_pal_get_col_rgb(nuru_pal_s* pal, uint8_t idx)
+{
+	return &pal->data.rgbs[idx];
+}
+
+/*
+ * Get the RGB value of an 8-bit ANSI color, as used by xterm by default.
+ * The first 16 colors are user configurable in most terminals, hence the 
+ * result for those can only ever be an approximation.
+ */
+NURU_SCOPE void
+nuru_ansi_to_rgb(uint8_t idx, nuru_rgb_s* rgb)
+{
+	static const uint8_t sys[16][3] = {
+		{   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+		{   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+		{ 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+		{  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 }
+	};
+	static const uint8_t cube[6] = { 0, 95, 135, 175, 215, 255 };
+
+	if (idx < 16)
+	{
+		rgb->r = sys[idx][0];
+		rgb->g = sys[idx][1];
+		rgb->b = sys[idx][2];
+	}
+	else if (idx < 232)
+	{
+		idx -= 16;
+		rgb->r = cube[(idx / 36)];
+		rgb->g = cube[(idx /  6) % 6];
+		rgb->b = cube[(idx     ) % 6];
+	}
+	else
+	{
+		rgb->r = rgb->g = rgb->b = 8 + (idx - 232) * 10;
+	}
+}
+
+/*
+ * Squared euclidean distance between two RGB colors.
+ */
+NURU_SCOPE uint32_t
+nuru_rgb_dist(nuru_rgb_s* a, nuru_rgb_s* b)
+{
+	int dr = a->r - b->r;
+	int dg = a->g - b->g;
+	int db = a->b - b->b;
+	return (dr * dr) + (dg * dg) + (db * db);
+}
+
+/*
+ * Find the 8-bit ANSI color closest to the given RGB color. Only the color 
+ * cube (16..231) and the grayscale ramp (232..255) are considered, as the 
+ * first 16 colors differ from terminal to terminal.
+ */
+NURU_SCOPE uint8_t
+nuru_rgb_to_ansi_8bit(nuru_rgb_s* rgb)
+{
+	// map each channel to the closest of the cube levels 0, 95, 135, ...
+	uint8_t ch[3] = { rgb->r, rgb->g, rgb->b };
+	for (int i = 0; i < 3; ++i)
+	{
+		ch[i] = ch[i] < 48 ? 0 : ch[i] < 115 ? 1 : (ch[i] - 35) / 40;
+	}
+	uint8_t cube_idx = 16 + (36 * ch[0]) + (6 * ch[1]) + ch[2];
+
+	// map the average brightness to the closest step of the gray ramp
+	int avg = (rgb->r + rgb->g + rgb->b) / 3;
+	uint8_t gray_idx = avg < 8 ? 232 : avg > 238 ? 255 : 232 + (avg - 3) / 10;
+
+	nuru_rgb_s cube_rgb, gray_rgb;
+	nuru_ansi_to_rgb(cube_idx, &cube_rgb);
+	nuru_ansi_to_rgb(gray_idx, &gray_rgb);
+
+	return nuru_rgb_dist(rgb, &gray_rgb) < nuru_rgb_dist(rgb, &cube_rgb) ?
+		gray_idx : cube_idx;
+}
+
+/*
+ * Find the 4-bit ANSI color closest to the given RGB color.
+ */
+NURU_SCOPE uint8_t
+nuru_rgb_to_ansi_4bit(nuru_rgb_s* rgb)
+{
+	nuru_rgb_s sys;
+	uint8_t  best = 0;
+	uint32_t best_dist = UINT32_MAX;
+
+	for (uint8_t i = 0; i < 16; ++i)
+	{
+		nuru_ansi_to_rgb(i, &sys);
+		uint32_t dist = nuru_rgb_dist(rgb, &sys);
+		if (dist < best_dist)
+		{
+			best = i;
+			best_dist = dist;
+		}
+	}
+	return best;
+}
+
+NURU_SCOPE int
+nuru_pal_load(nuru_pal_s* pal, const char* file)
+{
+	// open file
+	FILE* fp = fopen(file, "rb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_MEMORY;
+	}
+
+	// read signature
+	if (nuru_read_str(pal->signature, NURU_STR_LEN_RAW, fp) != 0)
+	{
+		fclose(fp);
+		return NURU_ERR_FILE_READ;
+	}
+	
+	if (strcmp(pal->signature, NURU_PAL_SIGNATURE) != 0)
+	{
+		fclose(fp);
+		return NURU_ERR_FILE_TYPE;
+	}
+
+	int errors = 0;
+
+	// read rest of header
+	errors += nuru_read_int(&pal->version, 1, fp);
+	errors += nuru_read_int(&pal->type,    1, fp);
+	errors += nuru_read_int(&pal->ch_key,  1, fp);
+	errors += nuru_read_int(&pal->fg_key,  1, fp);
+	errors += nuru_read_int(&pal->bg_key,  1, fp);
+	errors += nuru_read_str(pal->userdata, 4, fp);
+
+	if (errors > 0)
+	{
+		fclose(fp);
+		return NURU_ERR_FILE_READ;
+	}
+
+	// read payload
+	for (int i = 0; i < NURU_PAL_SIZE; ++i)
+	{
+		if (pal->type == NURU_PAL_TYPE_COLOR_8BIT)
+		{
+			if (nuru_read_int(&pal->data.colors[i], 1, fp) != 0)
+			{
+				fclose(fp);
+				return NURU_ERR_FILE_READ;
+			}
+		}
+		
+		if (pal->type == NURU_PAL_TYPE_GLYPH_UNICODE)
+		{
+			if (nuru_read_int(&pal->data.glyphs[i], 2, fp) != 0)
+			{
+				fclose(fp);
+				return NURU_ERR_FILE_READ;
+			}
+		}
+
+		if (pal->type == NURU_PAL_TYPE_COLOR_RGB)
+		{
+			if (nuru_read_rgb(&pal->data.rgbs[i], fp) != 0)
+			{
+				fclose(fp);
+				return NURU_ERR_FILE_READ;
+			}
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Prepare a quantizer that maps RGB colors to the closest of the `num` colors 
+ * in `rgbs`, never using the color index `skip` (pass -1 to use all). This 
+ * precomputes the closest color for every cell of an RGB cube, with 
+ * NURU_QUANT_BITS per channel, so nuru_quant_idx() boils down to a lookup. 
+ * nuru_img_rgbs() can be used to get the colors for an image and palette.
+ */
+NURU_SCOPE int
+nuru_quant_init(nuru_quant_s* q, nuru_rgb_s* rgbs, int num, int skip)
+{
+	if (num <= 0 || num > NURU_PAL_SIZE || (num == 1 && skip == 0))
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	memcpy(q->rgbs, rgbs, sizeof(nuru_rgb_s) * num);
+	q->num_rgbs = num;
+
+	const int shift = 8 - NURU_QUANT_BITS;
+	const int half  = 1 << (shift - 1);
+	uint8_t* cell = q->cube;
+
+	for (int r = 0; r < NURU_QUANT_SIZE; ++r)
+	{
+		for (int g = 0; g < NURU_QUANT_SIZE; ++g)
+		{
+			for (int b = 0; b < NURU_QUANT_SIZE; ++b)
+			{
+				// the center of this cell of the cube
+				nuru_rgb_s rgb = {
+					(r << shift) + half,
+					(g << shift) + half,
+					(b << shift) + half
+				};
+
+				uint8_t  best = 0;
+				uint32_t best_dist = UINT32_MAX;
+				for (int i = 0; i < num; ++i)
+				{
+					uint32_t dist = nuru_rgb_dist(&rgb, &q->rgbs[i]);
+					if (dist < best_dist && i != skip)
+					{
+						best = i;
+						best_dist = dist;
+					}
+				}
+				*cell++ = best;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Get the index of the color closest to `rgb`, via the quantizer's cube.
+ */
+NURU_SCOPE uint8_t
+nuru_quant_idx(nuru_quant_s* q, nuru_rgb_s* rgb)
+{
+	const int shift = 8 - NURU_QUANT_BITS;
+	return q->cube[
+		((rgb->r >> shift) << (NURU_QUANT_BITS * 2)) |
+		((rgb->g >> shift) << (NURU_QUANT_BITS    )) |
+		((rgb->b >> shift))
+	];
+}
+
+/*
+ * Get the number of bytes a single cell takes up in the image's payload,
+ * based on its glyph, color and meta data mode, or -1 for unknown modes.
+ */
+NURU_SCOPE int
+nuru_img_cell_size(nuru_img_s* img)
+{
+	int size = 0;
+	switch (img->glyph_mode)
+	{
+		case NURU_GLYPH_MODE_NONE:                 break;
+		case NURU_GLYPH_MODE_ASCII:   size += 1;   break;
+		case NURU_GLYPH_MODE_PALETTE: size += 1;   break;
+		case NURU_GLYPH_MODE_UNICODE: size += 2;   break;
+		default:                      return -1;
+	}
+	switch (img->color_mode)
+	{
+		case NURU_COLOR_MODE_NONE:                 break;
+		case NURU_COLOR_MODE_4BIT:    size += 1;   break;
+		case NURU_COLOR_MODE_8BIT:    size += 2;   break;
+		case NURU_COLOR_MODE_PALETTE: size += 2;   break;
+		default:                      return -1;
+	}
+	switch (img->mdata_mode)
+	{
+		case NURU_MDATA_MODE_NONE:                 break;
+		case NURU_MDATA_MODE_1BYTE:   size += 1;   break;
+		case NURU_MDATA_MODE_2BYTE:   size += 2;   break;
+		default:                      return -1;
+	}
+	return size;
+}
+
+/*
+ * Get the number of bytes of the image's header in a file, which depends on 
+ * the image's version, as version 2+ has the payload checksum in there.
+ */
+NURU_SCOPE int
+nuru_img_head_size(nuru_img_s* img)
+{
+	return NURU_IMG_HEAD_SIZE + (img->version >= 2 ? NURU_IMG_SUM_SIZE : 0);
+}
+
+/*
+ * Get the number of bytes of the image's payload in a file, computed from 
+ * its dimensions and modes, or -1 for unknown modes.
+ */
+NURU_SCOPE int64_t
+nuru_img_payload_size(nuru_img_s* img)
+{
+	int cell_size = nuru_img_cell_size(img);
+	return cell_size == -1 ? -1 : (int64_t) img->cols * img->rows * cell_size;
+}
+
+/*
+ * Put an integer of `size` bytes (1 or 2) into `buf`, in network byte order.
+ * Returns the number of bytes written.
+ */
+NURU_SCOPE size_t
+nuru_put_int(uint8_t* buf, uint16_t val, uint8_t size)
+{
+	if (size == 2)
+	{
+		buf[0] = val >> 8;
+		buf[1] = val & 0xFF;
+		return 2;
+	}
+	buf[0] = val & 0xFF;
+	return 1;
+}
+
+/*
+ * Put a string into `buf`, zero-padded to (or cut off at) `len` bytes.
+ */
+NURU_SCOPE size_t
+nuru_put_str(uint8_t* buf, const char* str, size_t len)
+{
+	size_t i = 0;
+	for (; i < len && str[i]; ++i)
+	{
+		buf[i] = str[i];
+	}
+	for (; i < len; ++i)
+	{
+		buf[i] = 0;
+	}
+	return len;
+}
+
+/*
+ * Encode a cell into `buf`, according to the image's modes. Returns the 
+ * number of bytes written.
+ */
+NURU_SCOPE size_t
+nuru_put_cell(uint8_t* buf, nuru_img_s* img, nuru_cell_s* cell)
+{
+	size_t len = 0;
+	switch (img->glyph_mode)
+	{
+		case NURU_GLYPH_MODE_ASCII:
+		case NURU_GLYPH_MODE_PALETTE:
+			len += nuru_put_int(buf + len, cell->ch, 1);
+			break;
+		case NURU_GLYPH_MODE_UNICODE:
+			len += nuru_put_int(buf + len, cell->ch, 2);
+			break;
+	}
+	switch (img->color_mode)
+	{
+		case NURU_COLOR_MODE_4BIT:
+			len += nuru_put_int(buf + len, ((cell->fg & 0x0F) << 4) | (cell->bg & 0x0F), 1);
+			break;
+		case NURU_COLOR_MODE_8BIT:
+		case NURU_COLOR_MODE_PALETTE:
+			len += nuru_put_int(buf + len, cell->fg, 1);
+			len += nuru_put_int(buf + len, cell->bg, 1);
+			break;
+	}
+	switch (img->mdata_mode)
+	{
+		case NURU_MDATA_MODE_1BYTE:
+			len += nuru_put_int(buf + len, cell->md, 1);
+			break;
+		case NURU_MDATA_MODE_2BYTE:
+			len += nuru_put_int(buf + len, cell->md, 2);
+			break;
+	}
+	return len;
+}
+
+/*
+ * Encode the image header into `buf`, which needs to hold at least 
+ * NURU_IMG_HEAD_SIZE bytes. Returns the number of bytes written.
+ */
+NURU_SCOPE size_t
+nuru_put_img_head(uint8_t* buf, nuru_img_s* img)
+{
+	size_t len = 0;
+	len += nuru_put_str(buf + len, NURU_IMG_SIGNATURE, NURU_STR_LEN_RAW);
+	len += nuru_put_int(buf + len, img->version, 1);
+	len += nuru_put_int(buf + len, img->glyph_mode, 1);
+	len += nuru_put_int(buf + len, img->color_mode, 1);
+	len += nuru_put_int(buf + len, img->mdata_mode, 1);
+	len += nuru_put_int(buf + len, img->cols, 2);
+	len += nuru_put_int(buf + len, img->rows, 2);
+	len += nuru_put_int(buf + len, img->ch_key, 1);
+	len += nuru_put_int(buf + len, img->fg_key, 1);
+	len += nuru_put_int(buf + len, img->bg_key, 1);
+	len += nuru_put_str(buf + len, img->glyph_pal, NURU_STR_LEN_RAW);
+	len += nuru_put_str(buf + len, img->color_pal, NURU_STR_LEN_RAW);
+	return len;
+}
+
+/*
+ * Write the image to the given file. The cells are encoded into a buffer 
+ * that gets written out whenever it is full, rather than writing each field 
+ * on its own. The image's signature field is ignored. For version 2+, the 
+ * payload's checksum is computed along the way and stored in the header.
+ */
+NURU_SCOPE int
+nuru_img_save(nuru_img_s* img, const char* file)
+{
+	if (nuru_img_cell_size(img) == -1)
+	{
+		return NURU_ERR_FILE_MODE;
+	}
+
+	FILE* fp = fopen(file, "wb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	nuru_hash_s h;
+	nuru_hash_init(&h);
+
+	// the checksum is filled in once the payload has been written
+	uint8_t buf[NURU_BUF_SIZE];
+	size_t head = nuru_put_img_head(buf, img);
+	if (img->version >= 2)
+	{
+		head += nuru_put_str(buf + head, "", NURU_IMG_SUM_SIZE);
+	}
+
+	size_t len = head;
+	size_t num_cells = (size_t) img->cols * img->rows;
+	int errors = 0;
+
+	for (size_t c = 0; c < num_cells; ++c)
+	{
+		// a cell takes 6 bytes at most
+		if (len + 6 > NURU_BUF_SIZE)
+		{
+			nuru_hash_update(&h, buf + head, len - head);
+			errors += fwrite(buf, 1, len, fp) != len;
+			len = head = 0;
+		}
+		len += nuru_put_cell(buf + len, img, &img->cells[c]);
+	}
+	nuru_hash_update(&h, buf + head, len - head);
+	errors += fwrite(buf, 1, len, fp) != len;
+
+	if (img->version >= 2)
+	{
+		uint32_t sum = img->checksum = nuru_hash_final(&h);
+		uint8_t raw[NURU_IMG_SUM_SIZE] = { sum >> 24, sum >> 16, sum >> 8, sum };
+		errors += fseek(fp, NURU_IMG_HEAD_SIZE, SEEK_SET) != 0;
+		errors += fwrite(raw, 1, sizeof(raw), fp) != sizeof(raw);
+	}
+	errors += fclose(fp) != 0;
+
+	return errors ? NURU_ERR_FILE_WRITE : 0;
+}
+
+/*
+ * Write the palette to the given file, in one go.
+ */
+NURU_SCOPE int
+nuru_pal_save(nuru_pal_s* pal, const char* file)
+{
+	uint8_t buf[NURU_PAL_HEAD_SIZE + (NURU_PAL_SIZE * 3)];
+	size_t len = 0;
+
+	len += nuru_put_str(buf + len, NURU_PAL_SIGNATURE, NURU_STR_LEN_RAW);
+	len += nuru_put_int(buf + len, pal->version, 1);
+	len += nuru_put_int(buf + len, pal->type, 1);
+	len += nuru_put_int(buf + len, pal->ch_key, 1);
+	len += nuru_put_int(buf + len, pal->fg_key, 1);
+	len += nuru_put_int(buf + len, pal->bg_key, 1);
+	len += nuru_put_str(buf + len, pal->userdata, 4);
+
+	for (int i = 0; i < NURU_PAL_SIZE; ++i)
+	{
+		switch (pal->type)
+		{
+			case NURU_PAL_TYPE_COLOR_8BIT:
+				len += nuru_put_int(buf + len, pal->data.colors[i], 1);
+				break;
+			case NURU_PAL_TYPE_GLYPH_UNICODE:
+				len += nuru_put_int(buf + len, pal->data.glyphs[i], 2);
+				break;
+			case NURU_PAL_TYPE_COLOR_RGB:
+				len += nuru_put_int(buf + len, pal->data.rgbs[i].r, 1);
+				len += nuru_put_int(buf + len, pal->data.rgbs[i].g, 1);
+				len += nuru_put_int(buf + len, pal->data.rgbs[i].b, 1);
+				break;
+			default:
+				return NURU_ERR_PAL_TYPE;
+		}
+	}
+
+	FILE* fp = fopen(file, "wb");
+	if (fp == NULL)
+	{
+		return NURU_ERR_FILE_OPEN;
+	}
+
+	int errors = fwrite(buf, 1, len, fp) != len;
+	errors += fclose(fp) != 0;
+	return errors ? NURU_ERR_FILE_WRITE : 0;
+}
+
+/*
+ * Get the RGB value of every color index in the given image's color mode.
+ * Returns the number of color indices available in that mode.
+ */
+NURU_SCOPE int
+nuru_img_rgbs(nuru_img_s* img, nuru_pal_s* pal, nuru_rgb_s* rgbs)
+{
+	int num = img->color_mode == NURU_COLOR_MODE_4BIT ? 16 : NURU_PAL_SIZE;
+	for (int i = 0; i < num; ++i)
+	{
+		if (img->color_mode != NURU_COLOR_MODE_PALETTE)
+		{
+			nuru_ansi_to_rgb(i, &rgbs[i]);
+		}
+		else if (pal && pal->type == NURU_PAL_TYPE_COLOR_8BIT)
+		{
+			nuru_ansi_to_rgb(nuru_pal_get_col_8bit(pal, i), &rgbs[i]);
+		}
+		else if (pal && pal->type == NURU_PAL_TYPE_COLOR_RGB)
+		{
+			rgbs[i] = *nuru_pal_get_col_rgb(pal, i);
+		}
+		else
+		{
+			rgbs[i] = (nuru_rgb_s) { 0 };
+		}
+	}
+	return num;
+}
+
+/*
+ * Turn one of the accumulated colors into a color index. If all source colors 
+ * were the same, that's the one, otherwise the average is mapped back to the 
+ * closest available color index. Mostly transparent means transparent.
+ */
+NURU_SCOPE uint8_t
+nuru_acc_color(nuru_acc_s* acc, int i, uint8_t key, nuru_rgb_s* rgbs, int num_rgbs)
+{
+	if (acc->keys[i] >= acc->num[i])
+	{
+		return key;
+	}
+	if (!acc->mixed[i])
+	{
+		return acc->first[i];
+	}
+
+	nuru_rgb_s avg = {
+		.r = acc->r[i] / acc->num[i],
+		.g = acc->g[i] / acc->num[i],
+		.b = acc->b[i] / acc->num[i]
+	};
+
+	uint8_t  best = acc->first[i];
+	uint32_t best_dist = UINT32_MAX;
+	for (int c = 0; c < num_rgbs; ++c)
+	{
+		uint32_t dist = nuru_rgb_dist(&avg, &rgbs[c]);
+		if (dist < best_dist && c != key)
+		{
+			best = c;
+			best_dist = dist;
+		}
+	}
+	return best;
+}
+
+NURU_SCOPE void
+nuru_acc_add(nuru_acc_s* acc, int i, uint8_t col, uint8_t key, nuru_rgb_s* rgbs)
+{
+	if (col == key)
+	{
+		++acc->keys[i];
+		return;
+	}
+	if (acc->num[i] == 0)
+	{
+		acc->first[i] = col;
+	}
+	acc->mixed[i] |= (col != acc->first[i]);
+	acc->r[i] += rgbs[col].r;
+	acc->g[i] += rgbs[col].g;
+	acc->b[i] += rgbs[col].b;
+	++acc->num[i];
+}
+
+/*
+ * Add a cell of image `img` to the accumulator. `rgbs` are the RGB values of 
+ * the image's color indices, see nuru_img_rgbs().
+ */
+NURU_SCOPE void
+nuru_acc_cell(nuru_acc_s* acc, nuru_cell_s* cell, nuru_img_s* img, nuru_rgb_s* rgbs)
+{
+	if (acc->ch_votes == 0)
+	{
+		acc->ch = cell->ch;
+	}
+	acc->ch_votes += (acc->ch == cell->ch) ? 1 : -1;
+
+	if (acc->md_votes == 0)
+	{
+		acc->md = cell->md;
+	}
+	acc->md_votes += (acc->md == cell->md) ? 1 : -1;
+
+	if (img->color_mode != NURU_COLOR_MODE_NONE)
+	{
+		nuru_acc_add(acc, 0, cell->fg, img->fg_key, rgbs);
+		nuru_acc_add(acc, 1, cell->bg, img->bg_key, rgbs);
+	}
+}
+
+/*
+ * Turn the accumulated cells into one, then reset the accumulator.
+ */
+NURU_SCOPE void
+nuru_acc_get(nuru_acc_s* acc, nuru_cell_s* cell, nuru_img_s* img, nuru_rgb_s* rgbs, int num_rgbs)
+{
+	uint8_t colored = img->color_mode != NURU_COLOR_MODE_NONE;
+	cell->ch = acc->ch;
+	cell->md = acc->md;
+	cell->fg = colored ? nuru_acc_color(acc, 0, img->fg_key, rgbs, num_rgbs) : 0;
+	cell->bg = colored ? nuru_acc_color(acc, 1, img->bg_key, rgbs, num_rgbs) : 0;
+	*acc = (nuru_acc_s) { 0 };
+}
+
+/*
+ * Scale `src` down to `cols` x `rows` cells, writing the result to `dst`, 
+ * whose cells will be reused if possible. Every destination cell is made up 
+ * of a box of source cells: colors are averaged (in RGB, via `pal` if the 
+ * image uses a color palette) and mapped back to the closest color index,
+ * glyphs and meta data are chosen by majority vote. The source is traversed 
+ * once, row by row, so this is O(source cells). Scaling up is not supported.
+ */
+NURU_SCOPE int
+nuru_img_scale(nuru_img_s* dst, nuru_img_s* src, uint16_t cols, uint16_t rows, nuru_pal_s* pal)
+{
+	if (cols == 0 || rows == 0 || cols > src->cols || rows > src->rows)
+	{
+		return NURU_ERR_OTHER;
+	}
+
+	// copy the header, then get the cells ready
+	memcpy(dst->signature, src->signature, NURU_STR_LEN);
+	memcpy(dst->glyph_pal, src->glyph_pal, NURU_STR_LEN);
+	memcpy(dst->color_pal, src->color_pal, NURU_STR_LEN);
+	dst->version    = src->version;
+	dst->glyph_mode = src->glyph_mode;
+	dst->color_mode = src->color_mode;
+	dst->mdata_mode = src->mdata_mode;
+	dst->ch_key     = src->ch_key;
+	dst->fg_key     = src->fg_key;
+	dst->bg_key     = src->bg_key;
+	dst->cols       = cols;
+	dst->rows       = rows;
+	dst->num_cells  = (size_t) cols * rows;
+
+	if (nuru_img_reserve(dst, dst->num_cells) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
+	if (dst->hash_rows && nuru_img_reserve_rows(dst) != 0)
+	{
+		return NURU_ERR_MEMORY;
+	}
+
+	nuru_acc_s* accs = calloc(cols, sizeof(nuru_acc_s));
+	uint16_t* col_map = malloc(sizeof(uint16_t) * src->cols);
+	if (accs == NULL || col_map == NULL)
+	{
+		free(accs);
+		free(col_map);
+		return NURU_ERR_MEMORY;
+	}
+
+	// which destination column each source column ends up in
+	for (uint32_t c = 0; c < src->cols; ++c)
+	{
+		col_map[c] = (c * cols) / src->cols;
+	}
+
+	nuru_rgb_s rgbs[NURU_PAL_SIZE];
+	int num_rgbs = nuru_img_rgbs(src, pal, rgbs);
+
+	for (uint32_t r = 0; r < src->rows; ++r)
+	{
+		nuru_cell_s* row = &src->cells[(size_t) r * src->cols];
+		for (uint32_t c = 0; c < src->cols; ++c)
+		{
+			nuru_acc_cell(&accs[col_map[c]], &row[c], src, rgbs);
+		}
+
+		// last source row for this destination row, write out the results
+		uint32_t dst_row = (r * rows) / src->rows;
+		if (r + 1 < src->rows && ((r + 1) * rows) / src->rows == dst_row)
+		{
+			continue;
+		}
+
+		nuru_cell_s* out = &dst->cells[(size_t) dst_row * cols];
+		for (uint16_t c = 0; c < cols; ++c)
+		{
+			nuru_acc_get(&accs[c], &out[c], src, rgbs, num_rgbs);
+		}
+		if (dst->hash_rows)
+		{
+			dst->row_hashes[dst_row] = nuru_img_row_hash(dst, dst_row);
+		}
+	}
+
+	free(accs);
+	free(col_map);
+	dst->hashes_valid = dst->hash_rows;
+	return dst->num_cells;
+}
+
 #endif /* NURU_IMPLEMENTATION */
 #endif /* NURU_H */